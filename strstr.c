@@ -1,352 +1,5034 @@
+#ifdef __linux__
+#define _GNU_SOURCE // for mremap
+#endif
 #include "strstr.h"
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <assert.h>
+#include <stdint.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <sys/syscall.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define STR_HAVE_URING
+#endif
+#endif
 
 //-------------------------------------------------------------------------------
 // Default allocator
 //-------------------------------------------------------------------------------
 
+static void out_of_memory(void)
+{
+	fprintf(stderr, "Fatal error! Memory allocation failed.\n");
+	exit(1);
+}
+
+// the requested string length doesn't fit into the length type
+static void length_overflow(void)
+{
+	fprintf(stderr, "Fatal error! String length overflow.\n");
+	exit(1);
+}
+
 static void *xmalloc(size_t size)
 {
 	void *m = malloc(size);
-	if (!m) {
-		fprintf(stderr, "Fatal error! Memory allocation failed.\n");
-		exit(1);
-	}
+	if (!m)
+		out_of_memory();
 	return m;
 }
 
-static __thread str_allocator_t allocator = {
-	xmalloc,
-	free
-};
+static void *xrealloc(void *ptr, size_t size)
+{
+	void *m = realloc(ptr, size);
+	if (!m)
+		out_of_memory();
+	return m;
+}
 
-void str_set_allocator(const str_allocator_t *a)
+static void *default_alloc(void *ctx, size_t size)
 {
-	allocator = *a;
+	return xmalloc(size);
 }
 
-void str_get_allocator(str_allocator_t *a)
+static void default_free(void *ctx, void *ptr, size_t size)
 {
-	*a = allocator;
+	free(ptr);
 }
 
+static void *default_resize(void *ctx, void *ptr, size_t old_size, size_t size)
+{
+	return xrealloc(ptr, size);
+}
+
+static const str_allocator_t default_allocator_v1 = {
+	xmalloc,
+	free,
+	xrealloc,
+	0
+};
+
+static __thread str_allocator2_t allocator = {
+	0,
+	default_alloc,
+	default_free,
+	default_resize,
+	0
+};
+
 //-------------------------------------------------------------------------------
-// STR
+// str_allocator_t adapter
 //-------------------------------------------------------------------------------
 
-static int is_cstr_in_str(str_t *str, const char *cstr)
+// the adapter's context, set by str_set_allocator
+static __thread str_allocator_t allocator_v1;
+
+static void *v1_alloc(void *ctx, size_t size)
 {
-	if ((str->data <= cstr) && (str->data + str->cap >= cstr))
-		return 1;
-	return 0;
+	return (*((str_allocator_t*)ctx)->malloc)(size);
 }
 
-//------------------------------------------------------------------------------
+static void v1_free(void *ctx, void *ptr, size_t size)
+{
+	(*((str_allocator_t*)ctx)->free)(ptr);
+}
 
-str_t *str_new(int cap)
+static void *v1_resize(void *ctx, void *ptr, size_t old_size, size_t size)
 {
-	if (cap <= 0)
-		cap = STR_DEFAULT_CAPACITY;
-	str_t *str = (*allocator.malloc)(sizeof(str_t) + cap + 1);
-	str->len = 0;
-	str->cap = cap;
-	str->data[0] = '\0';
-	return str;
+	return (*((str_allocator_t*)ctx)->realloc)(ptr, size);
 }
 
-void str_free(str_t *str)
+static size_t v1_good_size(void *ctx, size_t size)
 {
-	(*allocator.free)(str);
+	return (*((str_allocator_t*)ctx)->good_size)(size);
 }
 
-void str_clear(str_t *str)
+// And the other way around: str_get_allocator describes a str_allocator2_t
+// with these functions and str_set_allocator turns them back into the
+// original. Blocks allocated by calling them directly keep their size in
+// front, it's what the stateful 'free' needs.
+static __thread str_allocator2_t allocator_v2;
+
+#define V2_HEADER (2 * sizeof(size_t))
+
+static void *v2_malloc(size_t size)
 {
-	str->len = 0;
-	str->data[0] = '\0';
+	size_t *p = (*allocator_v2.alloc)(allocator_v2.ctx, V2_HEADER + size);
+	*p = size;
+	return (char*)p + V2_HEADER;
 }
 
-str_t *str_from_cstr(const char *cstr)
+static void v2_free(void *ptr)
 {
-	assert(cstr != 0);
-	return str_from_cstr_len(cstr, strlen(cstr));
+	if (!ptr)
+		return;
+	size_t *p = (size_t*)((char*)ptr - V2_HEADER);
+	(*allocator_v2.free)(allocator_v2.ctx, p, V2_HEADER + *p);
 }
 
-str_t *str_from_cstr_len(const char *cstr, int len)
+//------------------------------------------------------------------------------
+
+void str_set_allocator(const str_allocator_t *a)
 {
-	int cap = len > 0 ? len : STR_DEFAULT_CAPACITY;
-	str_t *str = (*allocator.malloc)(sizeof(str_t) + cap + 1);
-	str->len = len;
-	str->cap = cap;
-	if (len > 0)
-		memcpy(str->data, cstr, len);
-	str->data[len] = '\0';
-	return str;
+	if (a->malloc == v2_malloc) {
+		allocator = allocator_v2;
+		return;
+	}
+	allocator_v1 = *a;
+	allocator.ctx = &allocator_v1;
+	allocator.alloc = v1_alloc;
+	allocator.free = v1_free;
+	allocator.resize = a->realloc ? v1_resize : 0;
+	allocator.good_size = a->good_size ? v1_good_size : 0;
 }
 
-str_t *str_dup(const str_t *rhs)
+void str_get_allocator(str_allocator_t *a)
 {
-	assert(rhs != 0);
-	return str_from_cstr_len(rhs->data, rhs->len);
+	if (allocator.alloc == v1_alloc) {
+		*a = allocator_v1;
+	} else if (allocator.alloc == default_alloc) {
+		*a = default_allocator_v1;
+	} else {
+		allocator_v2 = allocator;
+		a->malloc = v2_malloc;
+		a->free = v2_free;
+		a->realloc = 0;
+		a->good_size = 0;
+	}
 }
 
-str_t *str_from_file(const char *filename)
+void str_set_allocator2(const str_allocator2_t *a)
 {
-	assert(filename != 0);
+	allocator = *a;
+}
 
-	struct stat st;
-	FILE *f;
-	str_t *str;
+void str_get_allocator2(str_allocator2_t *a)
+{
+	*a = allocator;
+}
 
-	if (-1 == stat(filename, &st))
-		return 0;
+//-------------------------------------------------------------------------------
+// Arena allocator
+//-------------------------------------------------------------------------------
 
-	f = fopen(filename, "r");
-	if (!f)
-		return 0;
+#define ARENA_ALIGN 8
 
+struct str_arena_block {
+	str_arena_block_t *prev;
+	size_t size;
+	size_t used;
+	char data[];
+};
 
-	str = (*allocator.malloc)(sizeof(str_t) + st.st_size + 1);
-	str->cap = str->len = st.st_size;
-	if (st.st_size != fread(str->data, 1, st.st_size, f)) {
-		fclose(f);
-		(*allocator.free)(str);
-		return 0;
+static size_t align_up(size_t n, size_t align)
+{
+	return (n + align - 1) & ~(align - 1);
+}
+
+static str_arena_block_t *arena_get_block(str_arena_t *arena, size_t size)
+{
+	// reuse a spare block if it's big enough, spare blocks are usually of
+	// the same size, so checking only the first one is fine
+	str_arena_block_t *b = arena->spare;
+	if (b && b->size >= size) {
+		arena->spare = b->prev;
+	} else {
+		if (size < arena->block_size)
+			size = arena->block_size;
+		b = xmalloc(sizeof(str_arena_block_t) + size);
+		b->size = size;
 	}
-	fclose(f);
-	str->data[st.st_size] = '\0';
-	return str;
+	b->used = 0;
+	b->prev = arena->head;
+	arena->head = b;
+	return b;
 }
 
-void str_ensure_cap(str_t **out_str, int n)
+static void *arena_alloc(void *ctx, size_t size)
 {
-	assert(out_str != 0);
-	assert(*out_str != 0);
+	str_arena_t *arena = ctx;
 
-	str_t *str = *out_str;
-	if (str->cap - str->len < n) {
-		int newcap = str->cap * 2;
-		if (newcap - str->len < n)
-			newcap = str->len + n;
+	size = align_up(size, ARENA_ALIGN);
+	str_arena_block_t *b = arena->head;
+	if (!b || b->size - b->used < size)
+		b = arena_get_block(arena, size);
 
-		str_t *newstr = (*allocator.malloc)(sizeof(str_t) + newcap + 1);
-		newstr->cap = newcap;
-		newstr->len = str->len;
-		if (str->len > 0)
-			memcpy(newstr->data, str->data, str->len + 1);
-		else
-			newstr->data[0] = '\0';
-		(*allocator.free)(str);
-		*out_str = newstr;
-	}
+	void *p = b->data + b->used;
+	b->used += size;
+	return p;
 }
 
-str_t *str_printf(const char *fmt, ...)
+static void arena_free(void *ctx, void *ptr, size_t size)
 {
-	assert(fmt != 0);
+	// memory is reclaimed by str_arena_reset/str_arena_release
+}
 
-	va_list va;
+static void *arena_resize(void *ctx, void *ptr, size_t old_size, size_t size)
+{
+	str_arena_t *arena = ctx;
+	str_arena_block_t *b = arena->head;
 
-	va_start(va, fmt);
-	int len = vsnprintf(0, 0, fmt, va);
-	va_end(va);
+	// the last allocation in the current block can grow in place and
+	// gives the tail back when it shrinks
+	old_size = align_up(old_size, ARENA_ALIGN);
+	size = align_up(size, ARENA_ALIGN);
+	int last = (char*)ptr + old_size == b->data + b->used;
+	if (size <= old_size) {
+		if (last)
+			b->used -= old_size - size;
+		return ptr;
+	}
+	if (last && b->size - b->used >= size - old_size) {
+		b->used += size - old_size;
+		return ptr;
+	}
 
-	str_t *str = (*allocator.malloc)(sizeof(str_t) + len + 1);
-	str->len = str->cap = len;
-	va_start(va, fmt);
-	vsnprintf(str->data, len + 1, fmt, va);
-	va_end(va);
-	return str;
+	void *newp = arena_alloc(ctx, size);
+	memcpy(newp, ptr, old_size);
+	return newp;
 }
 
-void str_add_str(str_t **str, const str_t *str2)
+static void free_blocks(str_arena_block_t *b)
 {
-	assert(str != 0);
-	assert(str2 != 0);
-	assert(*str != 0);
-	assert(*str != str2);
-
-	str_add_cstr_len(str, str2->data, str2->len);
+	while (b) {
+		str_arena_block_t *prev = b->prev;
+		free(b);
+		b = prev;
+	}
 }
 
-void str_add_cstr(str_t **str, const char *cstr)
+//------------------------------------------------------------------------------
+
+void str_arena_init(str_arena_t *arena, size_t block_size)
 {
-	assert(str != 0);
-	assert(cstr != 0);
-	assert(*str != 0);
-	assert(!is_cstr_in_str(*str, cstr));
+	assert(arena != 0);
 
-	str_add_cstr_len(str, cstr, strlen(cstr));
+	arena->head = 0;
+	arena->spare = 0;
+	arena->block_size = block_size ? block_size : STR_ARENA_BLOCK_SIZE;
 }
 
-void str_add_cstr_len(str_t **str, const char *data, int len)
+void str_arena_free(str_arena_t *arena)
 {
-	if (len <= 0)
-		return;
+	assert(arena != 0);
 
-	str_ensure_cap(str, len);
-
-	str_t *s = *str;
-	memcpy(&s->data[s->len], data, len + 1);
-	s->len += len;
+	free_blocks(arena->head);
+	free_blocks(arena->spare);
+	arena->head = 0;
+	arena->spare = 0;
 }
 
-void str_add_printf(str_t **str, const char *fmt, ...)
+void str_arena_reset(str_arena_t *arena)
 {
-	assert(str != 0);
-	assert(fmt != 0);
-	assert(*str != 0);
-	assert(!is_cstr_in_str(*str, fmt));
+	str_arena_mark_t zero = {0, 0};
+	str_arena_release(arena, zero);
+}
 
-	va_list va;
+str_arena_mark_t str_arena_mark(str_arena_t *arena)
+{
+	assert(arena != 0);
 
-	va_start(va, fmt);
-	int len = vsnprintf(0, 0, fmt, va);
-	va_end(va);
+	str_arena_mark_t m = {arena->head, arena->head ? arena->head->used : 0};
+	return m;
+}
 
-	str_ensure_cap(str, len);
+void str_arena_release(str_arena_t *arena, str_arena_mark_t mark)
+{
+	assert(arena != 0);
 
-	str_t *s = *str;
-	va_start(va, fmt);
-	vsnprintf(&s->data[s->len], len + 1, fmt, va);
-	va_end(va);
-	s->len += len;
+	// move all blocks allocated after the mark to the spare list
+	while (arena->head != mark.block) {
+		str_arena_block_t *b = arena->head;
+		assert(b != 0); // the mark doesn't belong to this arena
+		arena->head = b->prev;
+		b->prev = arena->spare;
+		arena->spare = b;
+	}
+	if (mark.block)
+		mark.block->used = mark.used;
 }
 
-void str_add_file(str_t **str, const char *filename)
+void str_arena_get_allocator(str_arena_t *arena, str_allocator2_t *out)
 {
-	assert(str != 0);
-	assert(filename != 0);
-	assert(*str != 0);
+	assert(arena != 0);
+	assert(out != 0);
 
-	struct stat st;
-	FILE *f;
+	out->ctx = arena;
+	out->alloc = arena_alloc;
+	out->free = arena_free;
+	out->resize = arena_resize;
+	out->good_size = 0;
+}
 
-	if (-1 == stat(filename, &st))
-		return;
+//-------------------------------------------------------------------------------
+// Pool allocator
+//-------------------------------------------------------------------------------
 
-	f = fopen(filename, "r");
-	if (!f)
-		return;
+// Blocks have no headers, 'free' receives the size of a block and that's how
+// it finds out the size class.
+//
+// Slabs are aligned to their size, a slab header at the beginning points to
+// the thread cache which owns the slab. A block freed by another thread is
+// pushed onto the owner's lock-free 'remote' list, the owner takes the whole
+// list at once when one of its free lists runs dry. When a thread exits, its
+// cache is abandoned and the next new thread adopts it, together with all the
+// blocks and remote frees.
+//
+// Slabs are also registered by address: a bitmap with a bit per slab for
+// every 4G of address space, the bitmaps are found through a small hash
+// table. That's how a pool block is recognized when it is freed by a thread
+// which has another allocator installed (see allocator_free). Slabs are never
+// unregistered. The other way around, blocks which aren't in the registry are
+// malloc blocks to the pool, just like its own blocks bigger than
+// STR_POOL_MAX_SIZE.
+#define POOL_CLASSES 12
+#define POOL_SLAB_SIZE 65536
+#define POOL_SLAB_HEADER 16
+#define POOL_REGIONS 1024
+#define POOL_REGION_SLABS (((uint64_t)1 << 32) / POOL_SLAB_SIZE)
 
-	str_ensure_cap(str, st.st_size);
-	str_t *s = *str;
-	if (st.st_size == fread(s->data + s->len, 1, st.st_size, f))
-		s->len += st.st_size;
-	fclose(f);
-	s->data[s->len] = '\0';
+typedef struct pool_block {
+	struct pool_block *next;
+} pool_block_t;
+
+typedef struct pool_cache {
+	pool_block_t *free_lists[POOL_CLASSES];
+	pool_block_t *remote; // atomic
+	struct pool_cache *next_abandoned;
+} pool_cache_t;
+
+typedef struct pool_slab {
+	pool_cache_t *owner;
+	int class;
+} pool_slab_t;
+
+typedef struct pool_region {
+	uint64_t base;   // address >> 32
+	uint64_t *slabs; // atomic, a bit per slab, set once the region is used
+} pool_region_t;
+
+static __thread pool_cache_t *pool_cache;
+
+static pthread_mutex_t pool_regions_lock = PTHREAD_MUTEX_INITIALIZER;
+static pool_region_t pool_regions[POOL_REGIONS];
+
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static pthread_key_t pool_key;
+static pthread_mutex_t pool_abandoned_lock = PTHREAD_MUTEX_INITIALIZER;
+static pool_cache_t *pool_abandoned;
+
+static int pool_class(size_t size)
+{
+	if (size <= 128)
+		return size ? (size - 1) / 16 : 0;
+	return 8 + (size - 129) / 32;
 }
 
-void str_trim(str_t *str)
+static size_t pool_class_size(int c)
 {
-	str_rtrim(str);
-	str_ltrim(str);
+	if (c < 8)
+		return (c + 1) * 16;
+	return 128 + (c - 7) * 32;
 }
 
-void str_ltrim(str_t *str)
+static pool_slab_t *pool_slab_of(void *ptr)
 {
-	char *c = str->data;
-	while (str->len > 0 && isspace(*c)) {
-		str->len--;
-		c++;
+	return (pool_slab_t*)((uintptr_t)ptr & ~(uintptr_t)(POOL_SLAB_SIZE - 1));
+}
+
+// Finds the bitmap of the region 'base' belongs to, with 'create' adds the
+// region if it isn't there, the caller must hold pool_regions_lock then.
+static uint64_t *pool_find_region(uint64_t base, int create)
+{
+	size_t i = base % POOL_REGIONS;
+	for (int n = 0; n < POOL_REGIONS; n++, i = (i + 1) % POOL_REGIONS) {
+		pool_region_t *r = &pool_regions[i];
+		uint64_t *slabs = __atomic_load_n(&r->slabs, __ATOMIC_ACQUIRE);
+		if (slabs && r->base == base)
+			return slabs;
+		if (slabs)
+			continue;
+		if (!create)
+			return 0;
+
+		slabs = xmalloc(POOL_REGION_SLABS / 8);
+		memset(slabs, 0, POOL_REGION_SLABS / 8);
+		r->base = base;
+		__atomic_store_n(&r->slabs, slabs, __ATOMIC_RELEASE);
+		return slabs;
 	}
-	memmove(str->data, c, str->len);
-	str->data[str->len] = '\0';
+	if (create)
+		out_of_memory();
+	return 0;
 }
 
-void str_rtrim(str_t *str)
+static void pool_register_slab(void *slab)
 {
-	while (str->len > 0 && isspace(str->data[str->len - 1]))
-		str->len--;
-	str->data[str->len] = '\0';
+	uint64_t addr = (uintptr_t)slab;
+	uint64_t i = (addr & 0xFFFFFFFF) / POOL_SLAB_SIZE;
+
+	pthread_mutex_lock(&pool_regions_lock);
+	uint64_t *slabs = pool_find_region(addr >> 32, 1);
+	pthread_mutex_unlock(&pool_regions_lock);
+	__atomic_fetch_or(&slabs[i / 64], (uint64_t)1 << (i % 64),
+			  __ATOMIC_RELEASE);
 }
 
-str_t *str_split_path(const str_t *str, str_t **half2)
+// whether 'ptr' points into a pool slab
+static int pool_owns(const void *ptr)
 {
-	const char *c = str->data + (str->len - 1);
-	while (c != str->data && *c != '/')
-		c--;
+	uint64_t addr = (uintptr_t)ptr;
+	uint64_t i = (addr & 0xFFFFFFFF) / POOL_SLAB_SIZE;
 
-	if (c == str->data) {
-		if (half2)
-			*half2 = str_dup(str);
+	uint64_t *slabs = pool_find_region(addr >> 32, 0);
+	if (!slabs)
 		return 0;
-	}
-
-	if (half2)
-		*half2 = str_from_cstr_len(c+1, str->data + str->len - (c+1));
+	return __atomic_load_n(&slabs[i / 64], __ATOMIC_ACQUIRE) >>
+		(i % 64) & 1;
+}
 
-	return str_from_cstr_len(str->data, c - str->data);
+static void pool_abandon(void *cache)
+{
+	pthread_mutex_lock(&pool_abandoned_lock);
+	((pool_cache_t*)cache)->next_abandoned = pool_abandoned;
+	pool_abandoned = cache;
+	pthread_mutex_unlock(&pool_abandoned_lock);
 }
 
-//-------------------------------------------------------------------------------
-// FSTR
-//-------------------------------------------------------------------------------
+static void pool_create_key(void)
+{
+	pthread_key_create(&pool_key, pool_abandon);
+}
 
-void fstr_add_cstr_len(fstr_t *fstr, const char *data, int len)
+static pool_cache_t *pool_init_cache(void)
 {
-	if (!len)
-		return;
+	pthread_once(&pool_once, pool_create_key);
 
-	int avail = fstr->cap - fstr->len;
-	if (len > avail)
-		len = avail;
+	pthread_mutex_lock(&pool_abandoned_lock);
+	pool_cache_t *cache = pool_abandoned;
+	if (cache)
+		pool_abandoned = cache->next_abandoned;
+	pthread_mutex_unlock(&pool_abandoned_lock);
 
-	memcpy(&fstr->data[fstr->len], data, len);
-	fstr->data[fstr->len + len] = '\0';
-	fstr->len += len;
+	if (!cache) {
+		cache = xmalloc(sizeof(pool_cache_t));
+		memset(cache, 0, sizeof(pool_cache_t));
+	}
+	pthread_setspecific(pool_key, cache);
+	pool_cache = cache;
+	return cache;
 }
 
-//------------------------------------------------------------------------------
+// moves all remotely freed blocks to the free lists, returns 0 if there were
+// none
+static int pool_drain_remote(pool_cache_t *cache)
+{
+	pool_block_t *b = __atomic_exchange_n(&cache->remote, 0,
+					      __ATOMIC_ACQUIRE);
+	if (!b)
+		return 0;
 
-void fstr_init(fstr_t *fstr, char *data, int len, int cap)
+	while (b) {
+		pool_block_t *next = b->next;
+		int c = pool_slab_of(b)->class;
+		b->next = cache->free_lists[c];
+		cache->free_lists[c] = b;
+		b = next;
+	}
+	return 1;
+}
+
+static void pool_refill(pool_cache_t *cache, int c)
 {
-	assert(fstr != 0);
-	assert(data != 0);
-	assert(cap >= len);
-	assert(cap > 0);
+	if (pool_drain_remote(cache) && cache->free_lists[c])
+		return;
 
-	fstr->cap = cap;
-	fstr->len = len;
-	fstr->data = data;
-	fstr->data[0] = '\0';
+	size_t bsize = pool_class_size(c);
+	void *mem;
+	if (posix_memalign(&mem, POOL_SLAB_SIZE, POOL_SLAB_SIZE) != 0)
+		out_of_memory();
+
+	pool_slab_t *slab = mem;
+	slab->owner = cache;
+	slab->class = c;
+	pool_register_slab(slab);
+
+	char *b = (char*)mem + POOL_SLAB_HEADER;
+	char *end = (char*)mem + POOL_SLAB_SIZE - bsize;
+	pool_block_t *list = cache->free_lists[c];
+	for (; b <= end; b += bsize) {
+		pool_block_t *block = (pool_block_t*)b;
+		block->next = list;
+		list = block;
+	}
+	cache->free_lists[c] = list;
 }
 
-void fstr_add_str(fstr_t *fstr, const str_t *str)
+static void *pool_alloc(void *ctx, size_t size)
 {
-	assert(fstr != 0);
-	assert(str != 0);
+	if (size > STR_POOL_MAX_SIZE)
+		return xmalloc(size);
 
-	fstr_add_cstr_len(fstr, str->data, str->len);
+	pool_cache_t *cache = pool_cache;
+	if (!cache)
+		cache = pool_init_cache();
+
+	int c = pool_class(size);
+	if (!cache->free_lists[c])
+		pool_refill(cache, c);
+	pool_block_t *block = cache->free_lists[c];
+	cache->free_lists[c] = block->next;
+	return block;
 }
 
-void fstr_add_cstr(fstr_t *fstr, const char *cstr)
+static void pool_free(void *ctx, void *ptr, size_t size)
 {
-	assert(fstr != 0);
-	assert(cstr != 0);
+	if (size > STR_POOL_MAX_SIZE || !pool_owns(ptr)) {
+		free(ptr);
+		return;
+	}
 
-	fstr_add_cstr_len(fstr, cstr, strlen(cstr));
+	pool_block_t *block = ptr;
+	pool_cache_t *owner = pool_slab_of(ptr)->owner;
+	if (owner == pool_cache) {
+		int c = pool_class(size);
+		block->next = owner->free_lists[c];
+		owner->free_lists[c] = block;
+		return;
+	}
+
+	block->next = __atomic_load_n(&owner->remote, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&owner->remote, &block->next, block,
+					    1, __ATOMIC_RELEASE,
+					    __ATOMIC_RELAXED))
+		;
 }
 
-void fstr_add_printf(fstr_t *fstr, const char *fmt, ...)
+static void *pool_resize(void *ctx, void *ptr, size_t old_size, size_t size)
 {
-	assert(fstr != 0);
-	assert(fmt != 0);
+	int owned = old_size <= STR_POOL_MAX_SIZE && pool_owns(ptr);
+	if (!owned && size > STR_POOL_MAX_SIZE)
+		return xrealloc(ptr, size);
+	if (owned && size <= STR_POOL_MAX_SIZE &&
+	    pool_class(size) == pool_class(old_size))
+		return ptr;
 
-	va_list va;
-	int avail = fstr->cap - fstr->len;
+	// moving to another size class or between a size class and malloc
+	void *newp = pool_alloc(ctx, size);
+	memcpy(newp, ptr, old_size < size ? old_size : size);
+	pool_free(ctx, ptr, old_size);
+	return newp;
+}
 
-	va_start(va, fmt);
-	int len = vsnprintf(&fstr->data[fstr->len], avail+1, fmt, va);
-	va_end(va);
+static size_t pool_good_size(void *ctx, size_t size)
+{
+	if (size > STR_POOL_MAX_SIZE)
+		return size;
+	return pool_class_size(pool_class(size));
+}
 
-	assert(len >= 0);
+//------------------------------------------------------------------------------
+
+void str_pool_get_allocator(str_allocator2_t *out)
+{
+	assert(out != 0);
+
+	out->ctx = 0;
+	out->alloc = pool_alloc;
+	out->free = pool_free;
+	out->resize = pool_resize;
+	out->good_size = pool_good_size;
+}
+
+//-------------------------------------------------------------------------------
+// Freeing and resizing
+//-------------------------------------------------------------------------------
+
+// Blocks of the pool are recognized by address and go back to the pool
+// whatever allocator is installed, so strings can be handed to threads which
+// don't use the pool. The rest goes to the installed allocator.
+static int is_pool_block(void *ptr, size_t size)
+{
+	return allocator.free != pool_free && size <= STR_POOL_MAX_SIZE &&
+		pool_owns(ptr);
+}
+
+static void allocator_free(void *ptr, size_t size)
+{
+	if (is_pool_block(ptr, size))
+		pool_free(0, ptr, size);
+	else
+		(*allocator.free)(allocator.ctx, ptr, size);
+}
+
+// whether allocator.resize can be used on 'ptr'
+static int can_resize(void *ptr, size_t size)
+{
+	return allocator.resize && !is_pool_block(ptr, size);
+}
+
+// Resizes an internal array allocated with the current allocator, 'ptr' can
+// be zero.
+static void *allocator_resize(void *ptr, size_t old_size, size_t size)
+{
+	if (!ptr)
+		return (*allocator.alloc)(allocator.ctx, size);
+	if (can_resize(ptr, old_size))
+		return (*allocator.resize)(allocator.ctx, ptr, old_size, size);
+
+	void *p = (*allocator.alloc)(allocator.ctx, size);
+	memcpy(p, ptr, old_size < size ? old_size : size);
+	allocator_free(ptr, old_size);
+	return p;
+}
+
+//-------------------------------------------------------------------------------
+// Statistics
+//-------------------------------------------------------------------------------
+
+#ifdef STR_STATS
+static __thread str_stats_t stats;
+#define STAT_ADD(field, n) (stats.field += (n))
+
+// Worker threads count into their own counters, stats_take moves them out
+// of the worker and stats_merge adds them to the thread which is waiting
+// for its results.
+static void stats_take(str_stats_t *out)
+{
+	*out = stats;
+	memset(&stats, 0, sizeof(str_stats_t));
+}
+
+static void stats_merge(const str_stats_t *s)
+{
+	stats.allocs += s->allocs;
+	stats.frees += s->frees;
+	stats.bytes_requested += s->bytes_requested;
+	stats.bytes_slack += s->bytes_slack;
+	stats.regrows += s->regrows;
+	stats.regrow_bytes_copied += s->regrow_bytes_copied;
+	stats.printf_double_passes += s->printf_double_passes;
+}
+#else
+#define STAT_ADD(field, n) ((void)0)
+#define stats_take(out) ((void)0)
+#define stats_merge(s) ((void)0)
+#endif
+
+void str_get_stats(str_stats_t *out)
+{
+	assert(out != 0);
+#ifdef STR_STATS
+	*out = stats;
+#else
+	memset(out, 0, sizeof(str_stats_t));
+#endif
+}
+
+void str_reset_stats(void)
+{
+#ifdef STR_STATS
+	memset(&stats, 0, sizeof(str_stats_t));
+#endif
+}
+
+//-------------------------------------------------------------------------------
+// Special strings
+//-------------------------------------------------------------------------------
+
+// Special strings have 'cap' set to STR_SPECIAL_CAP and a hidden header right
+// in front of the str_t. There is never enough "capacity" in them, that way
+// every append goes through str_ensure_cap, which knows what to do.
+//
+// Shared strings are frozen: immutable and reference counted. An append
+// detaches a private copy first.
+#define STR_SPECIAL_CAP -1
+
+enum {
+	STR_KIND_VM,
+	STR_KIND_SHARED
+};
+
+typedef struct str_ext {
+	int kind;
+	int cap;          // real capacity
+	int refs;         // SHARED: reference count, atomic
+	size_t size;      // VM: reserved bytes, SHARED: allocated bytes
+	size_t committed; // VM: read/write bytes, including headers
+} str_ext_t;
+
+static str_t *alloc_str(int cap);
+static int next_cap(int cap, int len, int n);
+
+#define VM_HEADER (sizeof(str_ext_t) + sizeof(str_t))
+#define VM_COMMIT_MIN 65536
+
+// not every system has it, PROT_NONE pages aren't committed anyway
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+static str_ext_t *str_ext(const str_t *str)
+{
+	return (str_ext_t*)str - 1;
+}
+
+static int str_real_cap(const str_t *str)
+{
+	return str->cap < 0 ? str_ext(str)->cap : str->cap;
+}
+
+static int is_frozen(const str_t *str)
+{
+	return str->cap < 0 && str_ext(str)->kind == STR_KIND_SHARED;
+}
+
+static void release_shared(str_t *str)
+{
+	str_ext_t *ext = str_ext(str);
+	if (__atomic_sub_fetch(&ext->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		allocator_free(ext, ext->size);
+		STAT_ADD(frees, 1);
+	}
+}
+
+// makes a private copy of a shared string and lets the shared one go
+static void detach_shared(str_t **out_str, int n)
+{
+	str_t *str = *out_str;
+	str_t *copy = alloc_str(next_cap(str->len, str->len, n));
+	copy->len = str->len;
+	memcpy(copy->data, str->data, str->len + 1);
+	release_shared(str);
+	*out_str = copy;
+}
+
+static size_t page_size(void)
+{
+	return sysconf(_SC_PAGESIZE);
+}
+
+static void vm_set_committed(str_ext_t *ext, size_t committed)
+{
+	ext->committed = committed;
+	committed -= VM_HEADER + 1;
+	ext->cap = committed > INT_MAX ? INT_MAX : committed;
+}
+
+// makes at least 'need' bytes of the reservation (headers included) readable
+// and writable, commits geometrically to keep the number of syscalls low
+static int vm_commit(str_ext_t *ext, size_t need)
+{
+	size_t size = ext->committed * 2;
+	if (size < need)
+		size = need;
+	size = align_up(size, page_size());
+	if (size > ext->size)
+		size = ext->size;
+
+	if (-1 == mprotect((char*)ext + ext->committed, size - ext->committed,
+			   PROT_READ | PROT_WRITE))
+		return 0;
+
+	vm_set_committed(ext, size);
+	return 1;
+}
+
+static void vm_grow(str_t **out_str, size_t need)
+{
+	str_ext_t *ext = str_ext(*out_str);
+	if (need <= ext->size) {
+		if (!vm_commit(ext, need))
+			out_of_memory();
+		return;
+	}
+
+	// out of reserved address space, move the pages to a bigger
+	// reservation
+	size_t size = ext->size * 2;
+	if (size < need)
+		size = need;
+	size = align_up(size, page_size());
+
+	size_t committed = ext->committed;
+#ifdef __linux__
+	// mremap doesn't copy anything, it just remaps pages
+	if (committed < ext->size)
+		munmap((char*)ext + committed, ext->size - committed);
+	ext = mremap(ext, committed, size, MREMAP_MAYMOVE);
+	if (ext == MAP_FAILED)
+		out_of_memory();
+
+	// the pages mremap adds are as accessible as the old ones, make them
+	// inaccessible again, so only what's needed is committed
+	if (-1 == mprotect((char*)ext + committed, size - committed, PROT_NONE))
+		out_of_memory();
+#else
+	// no mremap, copy the used part to a new reservation
+	str_ext_t *to = mmap(0, size, PROT_NONE,
+			     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (to == MAP_FAILED)
+		out_of_memory();
+	if (-1 == mprotect(to, committed, PROT_READ | PROT_WRITE))
+		out_of_memory();
+	memcpy(to, ext, VM_HEADER + (size_t)(*out_str)->len + 1);
+	STAT_ADD(regrow_bytes_copied, (*out_str)->len + 1);
+	munmap(ext, ext->size);
+	ext = to;
+#endif
+	ext->size = size;
+	*out_str = (str_t*)(ext + 1);
+	if (!vm_commit(ext, need))
+		out_of_memory();
+}
+
+static void ensure_cap_special(str_t **out_str, int n)
+{
+	str_t *str = *out_str;
+	str_ext_t *ext = str_ext(str);
+
+	switch (ext->kind) {
+	case STR_KIND_VM:
+		if (ext->cap - str->len < n)
+			vm_grow(out_str, VM_HEADER + (size_t)str->len + n + 1);
+		break;
+	case STR_KIND_SHARED:
+		detach_shared(out_str, n);
+		break;
+	}
+}
+
+static void free_special(str_t *str)
+{
+	str_ext_t *ext = str_ext(str);
+
+	switch (ext->kind) {
+	case STR_KIND_VM:
+		munmap(ext, ext->size);
+		STAT_ADD(frees, 1);
+		break;
+	case STR_KIND_SHARED:
+		release_shared(str);
+		break;
+	}
+}
+
+//------------------------------------------------------------------------------
+
+str_t *str_new_reserved(size_t reserve)
+{
+	size_t size = align_up(VM_HEADER + reserve + 1, page_size());
+	str_ext_t *ext = mmap(0, size, PROT_NONE,
+			      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+			      -1, 0);
+	if (ext == MAP_FAILED)
+		return 0;
+
+	size_t commit = align_up(VM_COMMIT_MIN, page_size());
+	if (commit > size)
+		commit = size;
+	if (-1 == mprotect(ext, commit, PROT_READ | PROT_WRITE)) {
+		munmap(ext, size);
+		return 0;
+	}
+
+	ext->kind = STR_KIND_VM;
+	ext->size = size;
+	vm_set_committed(ext, commit);
+	STAT_ADD(allocs, 1);
+	STAT_ADD(bytes_requested, commit);
+
+	str_t *str = (str_t*)(ext + 1);
+	str->cap = STR_SPECIAL_CAP;
+	str->len = 0;
+	str->data[0] = '\0';
+	return str;
+}
+
+str_t *str_freeze(str_t *str)
+{
+	assert(str != 0);
+
+	if (is_frozen(str))
+		return str;
+
+	size_t size = sizeof(str_ext_t) + sizeof(str_t) + str->len + 1;
+	str_ext_t *ext = (*allocator.alloc)(allocator.ctx, size);
+	ext->kind = STR_KIND_SHARED;
+	ext->cap = str->len;
+	ext->refs = 1;
+	ext->size = size;
+	STAT_ADD(allocs, 1);
+	STAT_ADD(bytes_requested, size);
+
+	str_t *frozen = (str_t*)(ext + 1);
+	frozen->cap = STR_SPECIAL_CAP;
+	frozen->len = str->len;
+	memcpy(frozen->data, str->data, str->len + 1);
+	str_free(str);
+	return frozen;
+}
+
+int str_is_frozen(const str_t *str)
+{
+	assert(str != 0);
+	return is_frozen(str);
+}
+
+int str_cap(const str_t *str)
+{
+	assert(str != 0);
+	return str_real_cap(str);
+}
+
+//-------------------------------------------------------------------------------
+// ASCII whitespace
+//-------------------------------------------------------------------------------
+
+// ' ', '\t', '\n', '\v', '\f', '\r', the same set as isspace in the "C" locale
+static int is_ascii_space(unsigned char c)
+{
+	return c == ' ' || (unsigned char)(c - '\t') <= '\r' - '\t';
+}
+
+#ifdef __AVX2__
+static unsigned space_mask32(const char *p)
+{
+	__m256i v = _mm256_loadu_si256((const __m256i*)p);
+	__m256i t = _mm256_sub_epi8(v, _mm256_set1_epi8('\t'));
+	__m256i ctl = _mm256_cmpeq_epi8(
+		_mm256_min_epu8(t, _mm256_set1_epi8('\r' - '\t')), t);
+	__m256i sp = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' '));
+	return _mm256_movemask_epi8(_mm256_or_si256(ctl, sp));
+}
+#endif
+
+#ifdef __SSE2__
+static unsigned space_mask16(const char *p)
+{
+	__m128i v = _mm_loadu_si128((const __m128i*)p);
+	__m128i t = _mm_sub_epi8(v, _mm_set1_epi8('\t'));
+	__m128i ctl = _mm_cmpeq_epi8(
+		_mm_min_epu8(t, _mm_set1_epi8('\r' - '\t')), t);
+	__m128i sp = _mm_cmpeq_epi8(v, _mm_set1_epi8(' '));
+	return _mm_movemask_epi8(_mm_or_si128(ctl, sp));
+}
+#endif
+
+// the number of ASCII whitespace bytes at the beginning of 'p'
+static size_t ascii_space_prefix(const char *p, size_t len)
+{
+	size_t i = 0;
+#ifdef __AVX2__
+	for (; i + 32 <= len; i += 32) {
+		unsigned mask = space_mask32(p + i);
+		if (mask != 0xFFFFFFFF)
+			return i + __builtin_ctz(~mask);
+	}
+#endif
+#ifdef __SSE2__
+	for (; i + 16 <= len; i += 16) {
+		unsigned mask = space_mask16(p + i);
+		if (mask != 0xFFFF)
+			return i + __builtin_ctz(~mask);
+	}
+#endif
+	while (i < len && is_ascii_space(p[i]))
+		i++;
+	return i;
+}
+
+// the number of ASCII whitespace bytes at the end of 'p'
+static size_t ascii_space_suffix(const char *p, size_t len)
+{
+	size_t i = len;
+#ifdef __AVX2__
+	for (; i >= 32; i -= 32) {
+		unsigned mask = ~space_mask32(p + i - 32);
+		if (mask)
+			return len - i + __builtin_clz(mask);
+	}
+#endif
+#ifdef __SSE2__
+	for (; i >= 16; i -= 16) {
+		unsigned mask = ~space_mask16(p + i - 16) & 0xFFFF;
+		if (mask)
+			return len - i + __builtin_clz(mask) - 16;
+	}
+#endif
+	while (i > 0 && is_ascii_space(p[i - 1]))
+		i--;
+	return len - i;
+}
+
+//-------------------------------------------------------------------------------
+// Numbers
+//-------------------------------------------------------------------------------
+
+static const char digit_pairs[201] =
+	"0001020304050607080910111213141516171819"
+	"2021222324252627282930313233343536373839"
+	"4041424344454647484950515253545556575859"
+	"6061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+// Writes 'v' backwards, ending right before 'end', returns the first digit.
+// 20 bytes is enough for any value.
+static char *u64_to_dec(char *end, uint64_t v)
+{
+	char *p = end;
+	while (v >= 100) {
+		unsigned i = (unsigned)(v % 100) * 2;
+		v /= 100;
+		p -= 2;
+		memcpy(p, &digit_pairs[i], 2);
+	}
+	if (v >= 10) {
+		p -= 2;
+		memcpy(p, &digit_pairs[v * 2], 2);
+	} else {
+		*--p = '0' + (char)v;
+	}
+	return p;
+}
+
+static char *i64_to_dec(char *end, int64_t v)
+{
+	if (v >= 0)
+		return u64_to_dec(end, v);
+	char *p = u64_to_dec(end, -(uint64_t)v);
+	*--p = '-';
+	return p;
+}
+
+static char *u64_to_hex(char *end, uint64_t v)
+{
+	char *p = end;
+	do {
+		*--p = "0123456789abcdef"[v & 15];
+		v >>= 4;
+	} while (v);
+	return p;
+}
+
+// Grisu2 (Florian Loitsch, "Printing Floating-Point Numbers Quickly and
+// Accurately with Integers"), the structure follows Milo Yip's
+// implementation. The output always reads back to the same double and it is
+// the shortest such output, except for a few doubles in a thousand where it is
+// a digit longer.
+
+typedef struct diyfp {
+	uint64_t f;
+	int e;
+} diyfp_t;
+
+// 10^k normalized, for k = -348, -340, ..., 340
+static const struct { uint64_t f; short e; short k; } cached_powers[] = {
+	{0xfa8fd5a0081c0288ULL, -1220, -348},
+	{0xbaaee17fa23ebf76ULL, -1193, -340},
+	{0x8b16fb203055ac76ULL, -1166, -332},
+	{0xcf42894a5dce35eaULL, -1140, -324},
+	{0x9a6bb0aa55653b2dULL, -1113, -316},
+	{0xe61acf033d1a45dfULL, -1087, -308},
+	{0xab70fe17c79ac6caULL, -1060, -300},
+	{0xff77b1fcbebcdc4fULL, -1034, -292},
+	{0xbe5691ef416bd60cULL, -1007, -284},
+	{0x8dd01fad907ffc3cULL,  -980, -276},
+	{0xd3515c2831559a83ULL,  -954, -268},
+	{0x9d71ac8fada6c9b5ULL,  -927, -260},
+	{0xea9c227723ee8bcbULL,  -901, -252},
+	{0xaecc49914078536dULL,  -874, -244},
+	{0x823c12795db6ce57ULL,  -847, -236},
+	{0xc21094364dfb5637ULL,  -821, -228},
+	{0x9096ea6f3848984fULL,  -794, -220},
+	{0xd77485cb25823ac7ULL,  -768, -212},
+	{0xa086cfcd97bf97f4ULL,  -741, -204},
+	{0xef340a98172aace5ULL,  -715, -196},
+	{0xb23867fb2a35b28eULL,  -688, -188},
+	{0x84c8d4dfd2c63f3bULL,  -661, -180},
+	{0xc5dd44271ad3cdbaULL,  -635, -172},
+	{0x936b9fcebb25c996ULL,  -608, -164},
+	{0xdbac6c247d62a584ULL,  -582, -156},
+	{0xa3ab66580d5fdaf6ULL,  -555, -148},
+	{0xf3e2f893dec3f126ULL,  -529, -140},
+	{0xb5b5ada8aaff80b8ULL,  -502, -132},
+	{0x87625f056c7c4a8bULL,  -475, -124},
+	{0xc9bcff6034c13053ULL,  -449, -116},
+	{0x964e858c91ba2655ULL,  -422, -108},
+	{0xdff9772470297ebdULL,  -396, -100},
+	{0xa6dfbd9fb8e5b88fULL,  -369,  -92},
+	{0xf8a95fcf88747d94ULL,  -343,  -84},
+	{0xb94470938fa89bcfULL,  -316,  -76},
+	{0x8a08f0f8bf0f156bULL,  -289,  -68},
+	{0xcdb02555653131b6ULL,  -263,  -60},
+	{0x993fe2c6d07b7facULL,  -236,  -52},
+	{0xe45c10c42a2b3b06ULL,  -210,  -44},
+	{0xaa242499697392d3ULL,  -183,  -36},
+	{0xfd87b5f28300ca0eULL,  -157,  -28},
+	{0xbce5086492111aebULL,  -130,  -20},
+	{0x8cbccc096f5088ccULL,  -103,  -12},
+	{0xd1b71758e219652cULL,   -77,   -4},
+	{0x9c40000000000000ULL,   -50,    4},
+	{0xe8d4a51000000000ULL,   -24,   12},
+	{0xad78ebc5ac620000ULL,     3,   20},
+	{0x813f3978f8940984ULL,    30,   28},
+	{0xc097ce7bc90715b3ULL,    56,   36},
+	{0x8f7e32ce7bea5c70ULL,    83,   44},
+	{0xd5d238a4abe98068ULL,   109,   52},
+	{0x9f4f2726179a2245ULL,   136,   60},
+	{0xed63a231d4c4fb27ULL,   162,   68},
+	{0xb0de65388cc8ada8ULL,   189,   76},
+	{0x83c7088e1aab65dbULL,   216,   84},
+	{0xc45d1df942711d9aULL,   242,   92},
+	{0x924d692ca61be758ULL,   269,  100},
+	{0xda01ee641a708deaULL,   295,  108},
+	{0xa26da3999aef774aULL,   322,  116},
+	{0xf209787bb47d6b85ULL,   348,  124},
+	{0xb454e4a179dd1877ULL,   375,  132},
+	{0x865b86925b9bc5c2ULL,   402,  140},
+	{0xc83553c5c8965d3dULL,   428,  148},
+	{0x952ab45cfa97a0b3ULL,   455,  156},
+	{0xde469fbd99a05fe3ULL,   481,  164},
+	{0xa59bc234db398c25ULL,   508,  172},
+	{0xf6c69a72a3989f5cULL,   534,  180},
+	{0xb7dcbf5354e9beceULL,   561,  188},
+	{0x88fcf317f22241e2ULL,   588,  196},
+	{0xcc20ce9bd35c78a5ULL,   614,  204},
+	{0x98165af37b2153dfULL,   641,  212},
+	{0xe2a0b5dc971f303aULL,   667,  220},
+	{0xa8d9d1535ce3b396ULL,   694,  228},
+	{0xfb9b7cd9a4a7443cULL,   720,  236},
+	{0xbb764c4ca7a44410ULL,   747,  244},
+	{0x8bab8eefb6409c1aULL,   774,  252},
+	{0xd01fef10a657842cULL,   800,  260},
+	{0x9b10a4e5e9913129ULL,   827,  268},
+	{0xe7109bfba19c0c9dULL,   853,  276},
+	{0xac2820d9623bf429ULL,   880,  284},
+	{0x80444b5e7aa7cf85ULL,   907,  292},
+	{0xbf21e44003acdd2dULL,   933,  300},
+	{0x8e679c2f5e44ff8fULL,   960,  308},
+	{0xd433179d9c8cb841ULL,   986,  316},
+	{0x9e19db92b4e31ba9ULL,  1013,  324},
+	{0xeb96bf6ebadf77d9ULL,  1039,  332},
+	{0xaf87023b9bf0ee6bULL,  1066,  340},
+};
+
+static const uint64_t pow10_u64[] = {
+	1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+	10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+	100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+	100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+	100000000000000000ULL, 1000000000000000000ULL,
+	10000000000000000000ULL,
+};
+
+static diyfp_t diyfp_make(uint64_t f, int e)
+{
+	diyfp_t r = {f, e};
+	return r;
+}
+
+static diyfp_t diyfp_normalize(diyfp_t x)
+{
+	int shift = __builtin_clzll(x.f);
+	return diyfp_make(x.f << shift, x.e - shift);
+}
+
+// the upper 64 bits of the product, rounded
+static diyfp_t diyfp_mul(diyfp_t x, diyfp_t y)
+{
+	const uint64_t M32 = 0xFFFFFFFF;
+	uint64_t a = x.f >> 32, b = x.f & M32;
+	uint64_t c = y.f >> 32, d = y.f & M32;
+	uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+	uint64_t mid = (bd >> 32) + (ad & M32) + (bc & M32) + (1ULL << 31);
+	return diyfp_make(ac + (ad >> 32) + (bc >> 32) + (mid >> 32),
+		x.e + y.e + 64);
+}
+
+// Picks a cached power c such that the exponent of w * c is in [-60, -32],
+// '*k' receives minus its decimal exponent.
+static diyfp_t cached_power(int e, int *k)
+{
+	double dk = (-61 - e) * 0.30102999566398114 + 347;
+	int ik = (int)dk;
+	if (dk - ik > 0.0)
+		ik++;
+	int i = (ik >> 3) + 1;
+	*k = -cached_powers[i].k;
+	return diyfp_make(cached_powers[i].f, cached_powers[i].e);
+}
+
+// Moves the last digit towards 'w' while it stays within the boundaries.
+static void grisu_round(char *buf, int len, uint64_t delta, uint64_t rest,
+	uint64_t ten_kappa, uint64_t wp_w)
+{
+	while (rest < wp_w && delta - rest >= ten_kappa &&
+		(rest + ten_kappa < wp_w ||
+		 wp_w - rest > rest + ten_kappa - wp_w))
+	{
+		buf[len - 1]--;
+		rest += ten_kappa;
+	}
+}
+
+// Generates the shortest digits of a number in (mp - delta, mp], the value is
+// digits * 10^k.
+static int grisu_digits(diyfp_t w, diyfp_t mp, uint64_t delta, char *buf,
+	int *k)
+{
+	const int shift = -mp.e;
+	const uint64_t one = 1ULL << shift;
+	const uint64_t wp_w = mp.f - w.f;
+	uint32_t p1 = (uint32_t)(mp.f >> shift);
+	uint64_t p2 = mp.f & (one - 1);
+	int len = 0;
+
+	int kappa = 1;
+	while (kappa < 10 && p1 >= pow10_u64[kappa])
+		kappa++;
+
+	while (kappa > 0) {
+		uint32_t div = (uint32_t)pow10_u64[kappa - 1];
+		uint32_t d = p1 / div;
+		p1 %= div;
+		if (d || len)
+			buf[len++] = '0' + (char)d;
+		kappa--;
+		uint64_t rest = ((uint64_t)p1 << shift) + p2;
+		if (rest <= delta) {
+			*k += kappa;
+			grisu_round(buf, len, delta, rest,
+				pow10_u64[kappa] << shift, wp_w);
+			return len;
+		}
+	}
+
+	for (;;) {
+		p2 *= 10;
+		delta *= 10;
+		char d = (char)(p2 >> shift);
+		if (d || len)
+			buf[len++] = '0' + d;
+		p2 &= one - 1;
+		kappa--;
+		if (p2 < delta) {
+			*k += kappa;
+			uint64_t unit = -kappa < 20 ? pow10_u64[-kappa] : 0;
+			grisu_round(buf, len, delta, p2, one, wp_w * unit);
+			return len;
+		}
+	}
+}
+
+// 'v' must be finite and positive
+static int grisu2(double v, char *buf, int *k)
+{
+	const uint64_t hidden = 1ULL << 52;
+	uint64_t bits;
+	memcpy(&bits, &v, sizeof(bits));
+	int biased = (int)(bits >> 52);
+	uint64_t f = bits & (hidden - 1);
+	int e;
+	if (biased) {
+		f |= hidden;
+		e = biased - 1075;
+	} else {
+		e = -1074;
+	}
+
+	// boundaries, the lower one is closer for powers of two
+	diyfp_t mp = diyfp_normalize(diyfp_make((f << 1) + 1, e - 1));
+	diyfp_t mm = (f == hidden && biased > 1) ?
+		diyfp_make((f << 2) - 1, e - 2) :
+		diyfp_make((f << 1) - 1, e - 1);
+	mm = diyfp_make(mm.f << (mm.e - mp.e), mp.e);
+
+	diyfp_t c = cached_power(mp.e, k);
+	diyfp_t w = diyfp_mul(diyfp_normalize(diyfp_make(f, e)), c);
+	mp = diyfp_mul(mp, c);
+	mm = diyfp_mul(mm, c);
+	mp.f--;
+	mm.f++;
+	return grisu_digits(w, mp, mp.f - mm.f, buf, k);
+}
+
+// Formats 'v' into 'out', which must have room for 25 bytes, returns the
+// length. The layout is the one of JavaScript's Number.prototype.toString.
+static int double_to_str(char *out, double v)
+{
+	char *p = out;
+	if (v != v) {
+		memcpy(out, "nan", 3);
+		return 3;
+	}
+	if (signbit(v)) {
+		*p++ = '-';
+		v = -v;
+	}
+	if (v == 0) {
+		*p++ = '0';
+		return p - out;
+	}
+	if (isinf(v)) {
+		memcpy(p, "inf", 3);
+		return p + 3 - out;
+	}
+
+	char digits[18];
+	int k;
+	int n = grisu2(v, digits, &k);
+	int point = n + k; // the position of the decimal point
+
+	if (n <= point && point <= 21) {
+		// 1234e7 -> 12340000000
+		memcpy(p, digits, n);
+		memset(p + n, '0', point - n);
+		p += point;
+	} else if (0 < point && point <= 21) {
+		// 1234e-2 -> 12.34
+		memcpy(p, digits, point);
+		p[point] = '.';
+		memcpy(p + point + 1, digits + point, n - point);
+		p += n + 1;
+	} else if (-6 < point && point <= 0) {
+		// 1234e-6 -> 0.001234
+		p[0] = '0';
+		p[1] = '.';
+		memset(p + 2, '0', -point);
+		memcpy(p + 2 - point, digits, n);
+		p += 2 - point + n;
+	} else {
+		// 1234e30 -> 1.234e+33
+		*p++ = digits[0];
+		if (n > 1) {
+			*p++ = '.';
+			memcpy(p, digits + 1, n - 1);
+			p += n - 1;
+		}
+		*p++ = 'e';
+		int exp = point - 1;
+		if (exp < 0) {
+			*p++ = '-';
+			exp = -exp;
+		} else {
+			*p++ = '+';
+		}
+		char tmp[4];
+		char *end = tmp + sizeof(tmp);
+		char *start = u64_to_dec(end, exp);
+		memcpy(p, start, end - start);
+		p += end - start;
+	}
+	return p - out;
+}
+
+//-------------------------------------------------------------------------------
+// STR
+//-------------------------------------------------------------------------------
+
+static int is_cstr_in_str(str_t *str, const char *cstr)
+{
+	if ((str->data <= cstr) && (str->data + str_real_cap(str) >= cstr))
+		return 1;
+	return 0;
+}
+
+// rounds the size of a str with capacity 'cap' up to what the allocator
+// really hands out
+static size_t str_size(int cap)
+{
+	size_t size = sizeof(str_t) + cap + 1;
+	if (allocator.good_size) {
+		// the rounded capacity must fit into an int too
+		size_t good = (*allocator.good_size)(allocator.ctx, size);
+		if (good - sizeof(str_t) - 1 <= INT_MAX)
+			size = good;
+	}
+	return size;
+}
+
+// allocates a str with at least 'cap' bytes of capacity, length is not set
+static str_t *alloc_str(int cap)
+{
+	size_t size = str_size(cap);
+	str_t *str = (*allocator.alloc)(allocator.ctx, size);
+	str->cap = size - sizeof(str_t) - 1;
+	STAT_ADD(allocs, 1);
+	STAT_ADD(bytes_requested, size);
+	return str;
+}
+
+// the allocator receives exactly the same size it was asked for, because
+// the capacity includes the rounding
+static void free_str(str_t *str)
+{
+	allocator_free(str, sizeof(str_t) + str->cap + 1);
+	STAT_ADD(frees, 1);
+}
+
+// the growth policy: double the capacity or take exactly what's needed if
+// doubling is not enough
+static int next_cap(int cap, int len, int n)
+{
+	if (n > INT_MAX - len)
+		length_overflow();
+	int newcap = cap > INT_MAX / 2 ? INT_MAX : cap * 2;
+	if (newcap - len < n)
+		newcap = len + n;
+	return newcap;
+}
+
+// Returns the number of bytes left in a regular file with a meaningful size,
+// 0 if the size is unknown (pipes, sockets, procfs), -1 on error or if there
+// are more than 'max' bytes left (errno is EFBIG then).
+static ssize_t fd_size_hint(int fd, size_t max)
+{
+	struct stat st;
+	if (-1 == fstat(fd, &st))
+		return -1;
+	if (!S_ISREG(st.st_mode) || st.st_size == 0)
+		return 0;
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	off_t pos = lseek(fd, 0, SEEK_CUR);
+	if (pos == -1 || pos >= st.st_size)
+		return 0;
+	if ((uint64_t)(st.st_size - pos) > max) {
+		errno = EFBIG;
+		return -1;
+	}
+	return st.st_size - pos;
+}
+
+// Sets the length of the string behind 'str' to 'len', makes room for at
+// least 'n' more bytes and returns its data, '*cap' receives the capacity.
+typedef char *(*read_reserve_t)(void *str, size_t len, size_t n, size_t *cap);
+
+// Reads the contents of 'fd' into a string with plain read calls, appending
+// them at 'start', the string never grows past 'max' bytes. If 'size' is
+// known, exactly 'size' bytes are read, usually with a single read. Otherwise
+// it reads until EOF, the read size starts at STR_READ_CHUNK and doubles each
+// time the buffer is filled. Returns the number of bytes read or -1 on error
+// (errno is EFBIG if the data doesn't fit), the caller sets the final length.
+static ssize_t read_fd_loop(void *str, read_reserve_t reserve, size_t start,
+			    size_t max, int fd, ssize_t size)
+{
+	size_t len = start;
+	size_t chunk = size > 0 ? (size_t)size : STR_READ_CHUNK;
+
+	for (;;) {
+		// after a short read only the rest of a known size is needed
+		if (size > 0)
+			chunk = start + size - len;
+		if (chunk > max - len)
+			chunk = max - len;
+		if (chunk == 0) {
+			// full, that's fine only if the stream ends right here
+			char c;
+			ssize_t n = read(fd, &c, 1);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n == 0)
+				break;
+			if (n > 0)
+				errno = EFBIG;
+			return -1;
+		}
+
+		size_t cap;
+		char *data = (*reserve)(str, len, chunk, &cap);
+		size_t avail = size > 0 ? start + size - len : cap - len;
+		ssize_t n = read(fd, data + len, avail);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		len += n;
+		if (n == 0 || (size > 0 && len - start == (size_t)size))
+			break;
+		if ((size_t)n == avail && chunk <= max / 2)
+			chunk *= 2;
+	}
+	return len - start;
+}
+
+static char *read_reserve(void *str, size_t len, size_t n, size_t *cap)
+{
+	str_t **s = str;
+	(*s)->len = len;
+	str_ensure_cap(s, n);
+	*cap = str_real_cap(*s);
+	return (*s)->data;
+}
+
+// Appends the contents of 'fd' to 'str', see read_fd_loop. On error the str
+// is left as it was and -1 is returned, otherwise the number of bytes read.
+static int read_fd(str_t **str, int fd, ssize_t size)
+{
+	int start = (*str)->len;
+	ssize_t n = read_fd_loop(str, read_reserve, start, INT_MAX, fd, size);
+	(*str)->len = n < 0 ? start : start + n;
+	(*str)->data[(*str)->len] = '\0';
+	return n;
+}
+
+//------------------------------------------------------------------------------
+
+str_t *str_new(int cap)
+{
+	if (cap <= 0)
+		cap = STR_DEFAULT_CAPACITY;
+	str_t *str = alloc_str(cap);
+	str->len = 0;
+	str->data[0] = '\0';
+	return str;
+}
+
+void str_free(str_t *str)
+{
+	STAT_ADD(bytes_slack, str_real_cap(str) - str->len);
+	if (str->cap < 0)
+		free_special(str);
+	else
+		free_str(str);
+}
+
+void str_clear(str_t *str)
+{
+	assert(!is_frozen(str));
+	str->len = 0;
+	str->data[0] = '\0';
+}
+
+str_t *str_from_cstr(const char *cstr)
+{
+	assert(cstr != 0);
+	return str_from_cstr_len(cstr, strlen(cstr));
+}
+
+str_t *str_from_cstr_len(const char *cstr, int len)
+{
+	str_t *str = alloc_str(len > 0 ? len : STR_DEFAULT_CAPACITY);
+	str->len = len;
+	if (len > 0)
+		memcpy(str->data, cstr, len);
+	str->data[len] = '\0';
+	return str;
+}
+
+str_t *str_dup(const str_t *rhs)
+{
+	assert(rhs != 0);
+
+	if (is_frozen(rhs)) {
+		__atomic_add_fetch(&str_ext(rhs)->refs, 1, __ATOMIC_RELAXED);
+		return (str_t*)rhs;
+	}
+	return str_from_cstr_len(rhs->data, rhs->len);
+}
+
+str_t *str_from_file(const char *filename)
+{
+	assert(filename != 0);
+
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1)
+		return 0;
+	str_t *str = str_from_fd(fd);
+	close(fd);
+	return str;
+}
+
+str_t *str_from_fd(int fd)
+{
+	ssize_t size = fd_size_hint(fd, INT_MAX);
+	if (size < 0)
+		return 0;
+
+	str_t *str = str_new(size);
+	if (-1 == read_fd(&str, fd, size)) {
+		str_free(str);
+		return 0;
+	}
+	return str;
+}
+
+void str_ensure_cap(str_t **out_str, int n)
+{
+	assert(out_str != 0);
+	assert(*out_str != 0);
+
+	// a no-op, even for special strings, which have a negative 'cap'
+	if (n == 0)
+		return;
+
+	str_t *str = *out_str;
+	if (str->cap - str->len < n) {
+		if (n > INT_MAX - str->len)
+			length_overflow();
+		if (str->cap < 0) {
+			ensure_cap_special(out_str, n);
+			return;
+		}
+
+		int newcap = next_cap(str->cap, str->len, n);
+
+		STAT_ADD(regrows, 1);
+		size_t old_size = sizeof(str_t) + str->cap + 1;
+		if (can_resize(str, old_size)) {
+			size_t size = str_size(newcap);
+			str = (*allocator.resize)(allocator.ctx, str, old_size,
+						  size);
+			str->cap = size - sizeof(str_t) - 1;
+			STAT_ADD(bytes_requested, size - old_size);
+			if (str != *out_str)
+				STAT_ADD(regrow_bytes_copied, str->len + 1);
+			*out_str = str;
+			return;
+		}
+
+		STAT_ADD(regrow_bytes_copied, str->len + 1);
+		str_t *newstr = alloc_str(newcap);
+		newstr->len = str->len;
+		if (str->len > 0)
+			memcpy(newstr->data, str->data, str->len + 1);
+		else
+			newstr->data[0] = '\0';
+		free_str(str);
+		*out_str = newstr;
+	}
+}
+
+str_t *str_printf(const char *fmt, ...)
+{
+	assert(fmt != 0);
+
+	va_list va;
+
+	va_start(va, fmt);
+	int len = vsnprintf(0, 0, fmt, va);
+	va_end(va);
+	STAT_ADD(printf_double_passes, 1);
+
+	str_t *str = alloc_str(len);
+	str->len = len;
+	va_start(va, fmt);
+	vsnprintf(str->data, len + 1, fmt, va);
+	va_end(va);
+	return str;
+}
+
+void str_add_str(str_t **str, const str_t *str2)
+{
+	assert(str != 0);
+	assert(str2 != 0);
+	assert(*str != 0);
+	// a shared string may be appended to itself, if there is another
+	// reference to it, which keeps it alive during detaching
+	assert(*str != str2 || (is_frozen(str2) && str_ext(str2)->refs > 1));
+
+	str_add_cstr_len(str, str2->data, str2->len);
+}
+
+void str_add_cstr(str_t **str, const char *cstr)
+{
+	assert(str != 0);
+	assert(cstr != 0);
+	assert(*str != 0);
+	assert(!is_cstr_in_str(*str, cstr));
+
+	str_add_cstr_len(str, cstr, strlen(cstr));
+}
+
+void str_add_cstr_len(str_t **str, const char *data, int len)
+{
+	if (len <= 0)
+		return;
+
+	str_ensure_cap(str, len);
+
+	str_t *s = *str;
+	memcpy(&s->data[s->len], data, len);
+	s->len += len;
+	s->data[s->len] = '\0';
+}
+
+void str_add_printf(str_t **str, const char *fmt, ...)
+{
+	assert(str != 0);
+	assert(fmt != 0);
+	assert(*str != 0);
+	assert(!is_cstr_in_str(*str, fmt));
+
+	va_list va;
+
+	va_start(va, fmt);
+	int len = vsnprintf(0, 0, fmt, va);
+	va_end(va);
+	if (len == 0)
+		return;
+	STAT_ADD(printf_double_passes, 1);
+
+	str_ensure_cap(str, len);
+
+	str_t *s = *str;
+	va_start(va, fmt);
+	vsnprintf(&s->data[s->len], len + 1, fmt, va);
+	va_end(va);
+	s->len += len;
+}
+
+void str_add_i64(str_t **str, int64_t v)
+{
+	char buf[20];
+	char *p = i64_to_dec(buf + sizeof(buf), v);
+	str_add_cstr_len(str, p, buf + sizeof(buf) - p);
+}
+
+void str_add_u64(str_t **str, uint64_t v)
+{
+	char buf[20];
+	char *p = u64_to_dec(buf + sizeof(buf), v);
+	str_add_cstr_len(str, p, buf + sizeof(buf) - p);
+}
+
+void str_add_hex(str_t **str, uint64_t v)
+{
+	char buf[16];
+	char *p = u64_to_hex(buf + sizeof(buf), v);
+	str_add_cstr_len(str, p, buf + sizeof(buf) - p);
+}
+
+void str_add_double(str_t **str, double v)
+{
+	char buf[32];
+	str_add_cstr_len(str, buf, double_to_str(buf, v));
+}
+
+void str_add_file(str_t **str, const char *filename)
+{
+	assert(str != 0);
+	assert(filename != 0);
+	assert(*str != 0);
+
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1)
+		return;
+	str_add_fd(str, fd);
+	close(fd);
+}
+
+int str_add_fd(str_t **str, int fd)
+{
+	assert(str != 0);
+	assert(*str != 0);
+
+	ssize_t size = fd_size_hint(fd, INT_MAX - (*str)->len);
+	if (size < 0)
+		return -1;
+	return read_fd(str, fd, size);
+}
+
+void str_trim(str_t *str)
+{
+	str_rtrim(str);
+	str_ltrim(str);
+}
+
+void str_ltrim(str_t *str)
+{
+	assert(!is_frozen(str));
+	char *c = str->data;
+	while (str->len > 0 && isspace((unsigned char)*c)) {
+		str->len--;
+		c++;
+	}
+	if (c != str->data)
+		memmove(str->data, c, str->len);
+	str->data[str->len] = '\0';
+}
+
+void str_rtrim(str_t *str)
+{
+	assert(!is_frozen(str));
+	while (str->len > 0 && isspace((unsigned char)str->data[str->len - 1]))
+		str->len--;
+	str->data[str->len] = '\0';
+}
+
+void str_trim_ascii(str_t *str)
+{
+	str_rtrim_ascii(str);
+	str_ltrim_ascii(str);
+}
+
+void str_ltrim_ascii(str_t *str)
+{
+	assert(!is_frozen(str));
+	int n = ascii_space_prefix(str->data, str->len);
+	if (n == 0)
+		return;
+	str->len -= n;
+	memmove(str->data, str->data + n, str->len + 1);
+}
+
+void str_rtrim_ascii(str_t *str)
+{
+	assert(!is_frozen(str));
+	str->len -= ascii_space_suffix(str->data, str->len);
+	str->data[str->len] = '\0';
+}
+
+void str_trim_offsets(const str_t *str, int *start, int *end)
+{
+	assert(str != 0);
+
+	int b = ascii_space_prefix(str->data, str->len);
+	int e = str->len;
+	if (b != e)
+		e -= ascii_space_suffix(str->data + b, str->len - b);
+	if (start)
+		*start = b;
+	if (end)
+		*end = e;
+}
+
+str_t *str_split_path(const str_t *str, str_t **half2)
+{
+	strview_t dir = {0}, file;
+	int has_dir = strview_split_path(strview_from_str(str), &dir, &file);
+	if (half2)
+		*half2 = str_from_strview(file);
+	return has_dir ? str_from_strview(dir) : 0;
+}
+
+//-------------------------------------------------------------------------------
+// Writing
+//-------------------------------------------------------------------------------
+
+#ifdef IOV_MAX
+#define STR_IOV_BATCH IOV_MAX
+#else
+#define STR_IOV_BATCH 1024
+#endif
+
+// Writes all of 'iov' to 'fd', resuming after partial writes and EINTR.
+// Modifies 'iov'.
+static int writev_all(int fd, struct iovec *iov, int cnt)
+{
+	while (cnt > 0) {
+		ssize_t n = writev(fd, iov, cnt);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		while (cnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt > 0) {
+			iov->iov_base = (char*)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+// Collects buffers into iovecs and writes them with writev_all once
+// STR_IOV_BATCH of them are queued.
+typedef struct {
+	int fd;
+	int cnt;
+	struct iovec iov[STR_IOV_BATCH];
+} iov_batch_t;
+
+// Queues 'len' bytes at 'data', empty buffers are skipped.
+static int iov_batch_add(iov_batch_t *b, const void *data, size_t len)
+{
+	if (len == 0)
+		return 0;
+	b->iov[b->cnt].iov_base = (void*)data;
+	b->iov[b->cnt].iov_len = len;
+	if (++b->cnt < STR_IOV_BATCH)
+		return 0;
+	b->cnt = 0;
+	return writev_all(b->fd, b->iov, STR_IOV_BATCH);
+}
+
+// Writes what's left in the batch.
+static int iov_batch_flush(iov_batch_t *b)
+{
+	int cnt = b->cnt;
+	b->cnt = 0;
+	return writev_all(b->fd, b->iov, cnt);
+}
+
+// 'strs' is either an array of str_t* or of fstr_t*, zero pointers and empty
+// strings are skipped
+static int writev_strs(int fd, const void *const *strs, int n, int fixed)
+{
+	iov_batch_t b;
+	b.fd = fd;
+	b.cnt = 0;
+	for (int i = 0; i < n; i++) {
+		if (!strs[i])
+			continue;
+		const char *data;
+		int len;
+		if (fixed) {
+			const fstr_t *f = strs[i];
+			data = f->data;
+			len = f->len;
+		} else {
+			const str_t *s = strs[i];
+			data = s->data;
+			len = s->len;
+		}
+		if (iov_batch_add(&b, data, len) == -1)
+			return -1;
+	}
+	return iov_batch_flush(&b);
+}
+
+// a rename survives a crash only once the directory is synced
+static int fsync_dir(const char *filename)
+{
+	strview_t dir;
+	str_t *path;
+	if (strview_split_path(strview_from_cstr(filename), &dir, 0))
+		path = str_from_strview(dir);
+	else
+		path = str_from_cstr(filename[0] == '/' ? "/" : ".");
+	int fd = open(path->data, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	str_free(path);
+	if (fd == -1)
+		return -1;
+
+	// some file systems can't sync directories, there is nothing to do
+	int ret = fsync(fd);
+	if (ret == -1 && errno == EINVAL)
+		ret = 0;
+	int err = errno;
+	close(fd);
+	errno = err;
+	return ret;
+}
+
+//------------------------------------------------------------------------------
+
+int str_write_fd(int fd, const str_t *str)
+{
+	assert(str != 0);
+	const void *strs[] = {str};
+	return writev_strs(fd, strs, 1, 0);
+}
+
+int str_writev_fd(int fd, const str_t *const *strs, int n)
+{
+	assert(strs != 0 || n == 0);
+	return writev_strs(fd, (const void *const *)strs, n, 0);
+}
+
+int fstr_writev_fd(int fd, const fstr_t *const *strs, int n)
+{
+	assert(strs != 0 || n == 0);
+	return writev_strs(fd, (const void *const *)strs, n, 1);
+}
+
+int str_writev_file(const char *filename, const str_t *const *strs, int n)
+{
+	assert(filename != 0);
+	assert(strs != 0 || n == 0);
+
+	// the temporary file is created next to the target, rename is atomic
+	// only within a file system
+	static unsigned counter;
+	str_t *tmp = str_new(strlen(filename) + 32);
+	int fd;
+	do {
+		str_clear(tmp);
+		str_add_printf(&tmp, "%s.tmp%ld.%u", filename, (long)getpid(),
+			       __atomic_fetch_add(&counter, 1,
+						  __ATOMIC_RELAXED));
+		fd = open(tmp->data, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+			  0666);
+	} while (fd == -1 && errno == EEXIST);
+	if (fd == -1)
+		goto error;
+
+	if (str_writev_fd(fd, strs, n) == -1 || fsync(fd) == -1) {
+		int err = errno;
+		close(fd);
+		unlink(tmp->data);
+		errno = err;
+		goto error;
+	}
+	if (close(fd) == -1 || rename(tmp->data, filename) == -1) {
+		int err = errno;
+		unlink(tmp->data);
+		errno = err;
+		goto error;
+	}
+	if (fsync_dir(filename) == -1)
+		goto error;
+	str_free(tmp);
+	return 0;
+
+error:
+	{
+		int err = errno;
+		str_free(tmp);
+		errno = err;
+	}
+	return -1;
+}
+
+//-------------------------------------------------------------------------------
+// Batch loading
+//-------------------------------------------------------------------------------
+
+// Worker threads allocate through the caller's allocator. The default and
+// the pool allocators are thread-safe and used as is, others are put behind
+// a lock, which serializes access to them.
+typedef struct locked_allocator {
+	str_allocator2_t a;
+	pthread_mutex_t lock;
+} locked_allocator_t;
+
+static void *locked_alloc(void *ctx, size_t size)
+{
+	locked_allocator_t *l = ctx;
+	pthread_mutex_lock(&l->lock);
+	void *p = (*l->a.alloc)(l->a.ctx, size);
+	pthread_mutex_unlock(&l->lock);
+	return p;
+}
+
+static void locked_free(void *ctx, void *ptr, size_t size)
+{
+	locked_allocator_t *l = ctx;
+	pthread_mutex_lock(&l->lock);
+	(*l->a.free)(l->a.ctx, ptr, size);
+	pthread_mutex_unlock(&l->lock);
+}
+
+static void *locked_resize(void *ctx, void *ptr, size_t old_size, size_t size)
+{
+	locked_allocator_t *l = ctx;
+	pthread_mutex_lock(&l->lock);
+	void *p = (*l->a.resize)(l->a.ctx, ptr, old_size, size);
+	pthread_mutex_unlock(&l->lock);
+	return p;
+}
+
+static size_t locked_good_size(void *ctx, size_t size)
+{
+	locked_allocator_t *l = ctx;
+	pthread_mutex_lock(&l->lock);
+	size = (*l->a.good_size)(l->a.ctx, size);
+	pthread_mutex_unlock(&l->lock);
+	return size;
+}
+
+static int allocator_is_thread_safe(void)
+{
+	return allocator.alloc == default_alloc || allocator.alloc == pool_alloc;
+}
+
+// Fills 'out' with the current allocator, behind the lock of 'l' unless it is
+// thread-safe. locked_allocator_destroy must be called with the same 'out'.
+static void locked_allocator_init(locked_allocator_t *l, str_allocator2_t *out)
+{
+	if (allocator_is_thread_safe()) {
+		*out = allocator;
+		return;
+	}
+
+	l->a = allocator;
+	pthread_mutex_init(&l->lock, 0);
+	out->ctx = l;
+	out->alloc = locked_alloc;
+	out->free = locked_free;
+	out->resize = l->a.resize ? locked_resize : 0;
+	out->good_size = l->a.good_size ? locked_good_size : 0;
+}
+
+static void locked_allocator_destroy(locked_allocator_t *l,
+				     const str_allocator2_t *a)
+{
+	if (a->alloc == locked_alloc)
+		pthread_mutex_destroy(&l->lock);
+}
+
+typedef struct load_batch {
+	str_allocator2_t allocator;
+	int dirfd;
+	const char **paths;
+	str_t **out;
+	int *errors;
+	int n;
+	int next;   // atomic, index of the next file to load
+	int failed; // atomic
+} load_batch_t;
+
+// a worker thread other than the calling one
+typedef struct load_thread {
+	load_batch_t *batch;
+#ifdef STR_STATS
+	str_stats_t stats;
+#endif
+} load_thread_t;
+
+static void *load_worker(void *arg)
+{
+	load_batch_t *b = arg;
+	str_allocator2_t old = allocator;
+	allocator = b->allocator;
+
+	for (;;) {
+		int i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED);
+		if (i >= b->n)
+			break;
+
+		str_t *str = 0;
+		int fd = openat(b->dirfd, b->paths[i], O_RDONLY);
+		if (fd != -1) {
+			str = str_from_fd(fd);
+			close(fd);
+		}
+		b->out[i] = str;
+		if (b->errors)
+			b->errors[i] = str ? 0 : errno;
+		if (!str)
+			__atomic_fetch_add(&b->failed, 1, __ATOMIC_RELAXED);
+	}
+
+	allocator = old;
+	return 0;
+}
+
+static void *load_thread(void *arg)
+{
+	load_thread_t *t = arg;
+	load_worker(t->batch);
+	stats_take(&t->stats);
+	return 0;
+}
+
+//------------------------------------------------------------------------------
+
+int str_from_files(int dirfd, const char **paths, int n, str_t **out,
+		   int *errors, int threads)
+{
+	assert(paths != 0);
+	assert(out != 0);
+	assert(n >= 0);
+
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads > STR_LOAD_MAX_THREADS)
+		threads = STR_LOAD_MAX_THREADS;
+	if (threads > n)
+		threads = n;
+	if (threads < 1)
+		threads = 1;
+
+	locked_allocator_t l;
+	load_batch_t b;
+	locked_allocator_init(&l, &b.allocator);
+	b.dirfd = dirfd;
+	b.paths = paths;
+	b.out = out;
+	b.errors = errors;
+	b.n = n;
+	b.next = 0;
+	b.failed = 0;
+
+	// the calling thread is one of the workers
+	pthread_t tids[STR_LOAD_MAX_THREADS];
+	load_thread_t ts[STR_LOAD_MAX_THREADS];
+	int started = 0;
+	for (int i = 1; i < threads; i++) {
+		ts[started].batch = &b;
+		if (pthread_create(&tids[started], 0, load_thread,
+				   &ts[started]) != 0)
+			break;
+		started++;
+	}
+	load_worker(&b);
+	for (int i = 0; i < started; i++) {
+		pthread_join(tids[i], 0);
+		stats_merge(&ts[i].stats);
+	}
+
+	locked_allocator_destroy(&l, &b.allocator);
+	return b.failed;
+}
+
+//-------------------------------------------------------------------------------
+// Asynchronous loading
+//-------------------------------------------------------------------------------
+
+// A load request lives from str_loader_submit until its callback is called.
+// The io_uring backend opens files in str_loader_submit and reads them with
+// IORING_OP_READ, the thread pool backend passes the file name to a worker,
+// which does str_from_file.
+typedef struct load_req {
+	struct load_req *next;
+	str_loader_cb_t cb;
+	void *data;
+	str_t *str;
+	int fd;
+	int size;  // known size or 0 if it's unknown
+	int chunk; // read size if the size is unknown
+	int error;
+	size_t alloc_size;
+#ifdef STR_STATS
+	str_stats_t stats; // counters of the worker which did the load
+#endif
+	char filename[];
+} load_req_t;
+
+struct str_loader {
+	// completed requests, their callbacks are called by str_loader_poll
+	load_req_t *done;
+	load_req_t **done_tail;
+	int pending;
+
+	int uring;
+#ifdef STR_HAVE_URING
+	int ring_fd;
+	unsigned sq_entries;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	struct io_uring_sqe *sqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size;
+	unsigned inflight;  // SQEs without a CQE yet, never above sq_entries
+	unsigned to_submit; // SQEs not yet passed to the kernel
+#endif
+
+	// the thread pool backend
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	load_req_t *queue;
+	load_req_t **queue_tail;
+	int stop;
+	int nthreads;
+	pthread_t threads[STR_LOADER_THREADS];
+	str_allocator2_t worker_allocator;
+	int copy; // workers use the default allocator, see loader_adopt
+};
+
+static load_req_t *load_req_new(const char *filename, str_loader_cb_t cb,
+				 void *data, int copy_filename)
+{
+	size_t size = sizeof(load_req_t);
+	if (copy_filename)
+		size += strlen(filename) + 1;
+
+	load_req_t *req = (*allocator.alloc)(allocator.ctx, size);
+	memset(req, 0, sizeof(load_req_t));
+	req->cb = cb;
+	req->data = data;
+	req->fd = -1;
+	req->alloc_size = size;
+	if (copy_filename)
+		strcpy(req->filename, filename);
+	return req;
+}
+
+static void load_req_free(load_req_t *req)
+{
+	allocator_free(req, req->alloc_size);
+}
+
+// The caller keeps allocating while workers run, an allocator which isn't
+// thread-safe can't be shared with them even behind a lock. Workers of such a
+// loader read with the default allocator and the result is copied.
+static str_t *loader_adopt(str_loader_t *l, str_t *str)
+{
+	if (!l->copy || !str)
+		return str;
+
+	str_t *copy = str_from_cstr_len(str->data, str->len);
+	default_free(0, str, sizeof(str_t) + str->cap + 1);
+	return copy;
+}
+
+static void loader_push_done(str_loader_t *l, load_req_t *req)
+{
+	req->next = 0;
+	*l->done_tail = req;
+	l->done_tail = &req->next;
+}
+
+// takes the whole list of completed requests
+static load_req_t *loader_take_done(str_loader_t *l)
+{
+	load_req_t *done = l->done;
+	l->done = 0;
+	l->done_tail = &l->done;
+	return done;
+}
+
+//------------------------------------------------------------------------------
+// io_uring backend
+//------------------------------------------------------------------------------
+
+#ifdef STR_HAVE_URING
+
+static int uring_setup(str_loader_t *l, unsigned entries)
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	int fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (fd < 0)
+		return 0;
+
+	// IORING_OP_READ and IORING_OP_CLOSE appeared together with this
+	// feature (linux 5.6)
+	if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+		close(fd);
+		return 0;
+	}
+
+	l->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	l->cq_ring_size = p.cq_off.cqes +
+			  p.cq_entries * sizeof(struct io_uring_cqe);
+	int single = p.features & IORING_FEAT_SINGLE_MMAP;
+	if (single) {
+		if (l->cq_ring_size > l->sq_ring_size)
+			l->sq_ring_size = l->cq_ring_size;
+		l->cq_ring_size = l->sq_ring_size;
+	}
+
+	l->sq_ring = mmap(0, l->sq_ring_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	l->cq_ring = single ? l->sq_ring :
+		     mmap(0, l->cq_ring_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	l->sqes = mmap(0, p.sq_entries * sizeof(struct io_uring_sqe),
+		       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		       fd, IORING_OFF_SQES);
+	if (l->sq_ring == MAP_FAILED || l->cq_ring == MAP_FAILED ||
+	    l->sqes == MAP_FAILED)
+	{
+		if (l->sq_ring != MAP_FAILED)
+			munmap(l->sq_ring, l->sq_ring_size);
+		if (!single && l->cq_ring != MAP_FAILED)
+			munmap(l->cq_ring, l->cq_ring_size);
+		if (l->sqes != MAP_FAILED)
+			munmap(l->sqes, p.sq_entries *
+			       sizeof(struct io_uring_sqe));
+		close(fd);
+		return 0;
+	}
+
+	char *sq = l->sq_ring, *cq = l->cq_ring;
+	l->ring_fd = fd;
+	l->sq_entries = p.sq_entries;
+	l->sq_head = (unsigned*)(sq + p.sq_off.head);
+	l->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+	l->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+	l->sq_array = (unsigned*)(sq + p.sq_off.array);
+	l->cq_head = (unsigned*)(cq + p.cq_off.head);
+	l->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+	l->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+	l->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+	return 1;
+}
+
+static void uring_destroy(str_loader_t *l)
+{
+	munmap(l->sqes, l->sq_entries * sizeof(struct io_uring_sqe));
+	if (l->cq_ring != l->sq_ring)
+		munmap(l->cq_ring, l->cq_ring_size);
+	munmap(l->sq_ring, l->sq_ring_size);
+	close(l->ring_fd);
+}
+
+// the caller makes sure there is a free slot: inflight < sq_entries
+static struct io_uring_sqe *uring_get_sqe(str_loader_t *l)
+{
+	unsigned tail = *l->sq_tail;
+	unsigned idx = tail & *l->sq_mask;
+	struct io_uring_sqe *sqe = &l->sqes[idx];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	l->sq_array[idx] = idx;
+	__atomic_store_n(l->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	l->inflight++;
+	l->to_submit++;
+	return sqe;
+}
+
+static void uring_enter(str_loader_t *l, unsigned min_complete)
+{
+	unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+	if (!l->to_submit && !min_complete)
+		return;
+
+	int n = syscall(__NR_io_uring_enter, l->ring_fd, l->to_submit,
+			min_complete, flags, 0, 0);
+	if (n > 0)
+		l->to_submit -= n;
+}
+
+static void uring_read(str_loader_t *l, load_req_t *req)
+{
+	str_t *s = req->str;
+	int avail;
+	if (req->size > 0) {
+		avail = req->size - s->len;
+	} else {
+		if (req->chunk > INT_MAX - s->len)
+			req->chunk = INT_MAX - s->len;
+		str_ensure_cap(&req->str, req->chunk);
+		s = req->str;
+		avail = str_real_cap(s) - s->len;
+	}
+
+	struct io_uring_sqe *sqe = uring_get_sqe(l);
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = req->fd;
+	sqe->addr = (uintptr_t)(s->data + s->len);
+	sqe->len = avail;
+	sqe->off = s->len;
+	sqe->user_data = (uintptr_t)req;
+}
+
+static void uring_finish(str_loader_t *l, load_req_t *req, int error)
+{
+	// the fd is closed asynchronously, its completion is ignored
+	struct io_uring_sqe *sqe = uring_get_sqe(l);
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->fd = req->fd;
+	sqe->user_data = 0;
+	req->fd = -1;
+
+	req->error = error;
+	if (error) {
+		str_free(req->str);
+		req->str = 0;
+	} else {
+		req->str->data[req->str->len] = '\0';
+	}
+	loader_push_done(l, req);
+}
+
+static void uring_complete(str_loader_t *l, load_req_t *req, int res)
+{
+	if (res < 0) {
+		if (res == -EINTR || res == -EAGAIN)
+			uring_read(l, req);
+		else
+			uring_finish(l, req, -res);
+		return;
+	}
+
+	str_t *s = req->str;
+	int full = res == str_real_cap(s) - s->len;
+	s->len += res;
+	if (res == 0 || (req->size > 0 && s->len == req->size)) {
+		uring_finish(l, req, 0);
+		return;
+	}
+	if (s->len == INT_MAX) {
+		uring_finish(l, req, EFBIG);
+		return;
+	}
+	if (full && req->chunk <= INT_MAX / 2)
+		req->chunk *= 2;
+	uring_read(l, req);
+}
+
+// handles all available completions
+static void uring_reap(str_loader_t *l)
+{
+	unsigned head = *l->cq_head;
+	unsigned tail = __atomic_load_n(l->cq_tail, __ATOMIC_ACQUIRE);
+
+	while (head != tail) {
+		struct io_uring_cqe *cqe = &l->cqes[head & *l->cq_mask];
+		load_req_t *req = (load_req_t*)(uintptr_t)cqe->user_data;
+		int res = cqe->res;
+		head++;
+		// every completion frees a slot, a read completion may take
+		// it right back for the next read or the close
+		l->inflight--;
+		if (req)
+			uring_complete(l, req, res);
+	}
+	__atomic_store_n(l->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static int uring_submit(str_loader_t *l, const char *filename,
+			str_loader_cb_t cb, void *data)
+{
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1)
+		return -1;
+	ssize_t size = fd_size_hint(fd, INT_MAX);
+	if (size < 0) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+
+	// wait for a free slot
+	while (l->inflight == l->sq_entries) {
+		uring_enter(l, 1);
+		uring_reap(l);
+	}
+
+	load_req_t *req = load_req_new(filename, cb, data, 0);
+	req->fd = fd;
+	req->size = size;
+	req->chunk = STR_READ_CHUNK;
+	req->str = str_new(size);
+	l->pending++;
+	uring_read(l, req);
+	return 0;
+}
+
+#endif // STR_HAVE_URING
+
+//------------------------------------------------------------------------------
+// thread pool backend
+//------------------------------------------------------------------------------
+
+static void *loader_worker(void *arg)
+{
+	str_loader_t *l = arg;
+	if (!l->copy)
+		allocator = l->worker_allocator;
+
+	pthread_mutex_lock(&l->lock);
+	for (;;) {
+		while (!l->queue && !l->stop)
+			pthread_cond_wait(&l->work_cond, &l->lock);
+		if (l->stop)
+			break;
+
+		load_req_t *req = l->queue;
+		l->queue = req->next;
+		if (!l->queue)
+			l->queue_tail = &l->queue;
+		pthread_mutex_unlock(&l->lock);
+
+		req->str = str_from_file(req->filename);
+		req->error = req->str ? 0 : errno;
+		stats_take(&req->stats);
+
+		pthread_mutex_lock(&l->lock);
+		loader_push_done(l, req);
+		pthread_cond_signal(&l->done_cond);
+	}
+	pthread_mutex_unlock(&l->lock);
+	return 0;
+}
+
+static int pool_submit(str_loader_t *l, const char *filename,
+		       str_loader_cb_t cb, void *data)
+{
+	load_req_t *req = load_req_new(filename, cb, data, 1);
+	l->pending++;
+
+	pthread_mutex_lock(&l->lock);
+	*l->queue_tail = req;
+	l->queue_tail = &req->next;
+	pthread_cond_signal(&l->work_cond);
+	pthread_mutex_unlock(&l->lock);
+	return 0;
+}
+
+static int pool_start(str_loader_t *l)
+{
+	pthread_mutex_init(&l->lock, 0);
+	pthread_cond_init(&l->work_cond, 0);
+	pthread_cond_init(&l->done_cond, 0);
+	l->queue = 0;
+	l->queue_tail = &l->queue;
+	l->stop = 0;
+	l->worker_allocator = allocator;
+	l->copy = !allocator_is_thread_safe();
+
+	l->nthreads = 0;
+	for (int i = 0; i < STR_LOADER_THREADS; i++) {
+		if (pthread_create(&l->threads[i], 0, loader_worker, l) != 0)
+			break;
+		l->nthreads++;
+	}
+	return l->nthreads > 0;
+}
+
+static void pool_stop(str_loader_t *l)
+{
+	pthread_mutex_lock(&l->lock);
+	l->stop = 1;
+	pthread_cond_broadcast(&l->work_cond);
+	pthread_mutex_unlock(&l->lock);
+	for (int i = 0; i < l->nthreads; i++)
+		pthread_join(l->threads[i], 0);
+
+	// requests which never started
+	while (l->queue) {
+		load_req_t *req = l->queue;
+		l->queue = req->next;
+		load_req_free(req);
+	}
+	pthread_cond_destroy(&l->done_cond);
+	pthread_cond_destroy(&l->work_cond);
+	pthread_mutex_destroy(&l->lock);
+}
+
+//------------------------------------------------------------------------------
+
+str_loader_t *str_loader_new(int depth, int flags)
+{
+	if (depth <= 0)
+		depth = STR_LOADER_DEPTH;
+
+	str_loader_t *l = (*allocator.alloc)(allocator.ctx,
+					     sizeof(str_loader_t));
+	memset(l, 0, sizeof(str_loader_t));
+	l->done_tail = &l->done;
+
+#ifdef STR_HAVE_URING
+	if (!(flags & STR_LOADER_NO_URING) && uring_setup(l, depth)) {
+		l->uring = 1;
+		return l;
+	}
+#endif
+	if (!pool_start(l)) {
+		pool_stop(l);
+		allocator_free(l, sizeof(str_loader_t));
+		return 0;
+	}
+	return l;
+}
+
+void str_loader_free(str_loader_t *l)
+{
+	assert(l != 0);
+
+#ifdef STR_HAVE_URING
+	if (l->uring) {
+		// the kernel may still write into the buffers, wait for all
+		// the reads to finish
+		while (l->inflight > 0) {
+			uring_enter(l, 1);
+			uring_reap(l);
+		}
+		uring_destroy(l);
+	}
+#endif
+	if (!l->uring)
+		pool_stop(l);
+
+	load_req_t *req = loader_take_done(l);
+	while (req) {
+		load_req_t *next = req->next;
+		stats_merge(&req->stats);
+		if (req->str)
+			str_free(loader_adopt(l, req->str));
+		load_req_free(req);
+		req = next;
+	}
+	allocator_free(l, sizeof(str_loader_t));
+}
+
+int str_loader_submit(str_loader_t *l, const char *filename,
+		      str_loader_cb_t cb, void *data)
+{
+	assert(l != 0);
+	assert(filename != 0);
+	assert(cb != 0);
+
+#ifdef STR_HAVE_URING
+	if (l->uring)
+		return uring_submit(l, filename, cb, data);
+#endif
+	return pool_submit(l, filename, cb, data);
+}
+
+int str_loader_pending(str_loader_t *l)
+{
+	assert(l != 0);
+	return l->pending;
+}
+
+int str_loader_poll(str_loader_t *l, int wait)
+{
+	assert(l != 0);
+
+	load_req_t *done = 0;
+#ifdef STR_HAVE_URING
+	if (l->uring) {
+		uring_enter(l, 0);
+		uring_reap(l);
+		while (wait && !l->done && l->pending > 0) {
+			uring_enter(l, 1);
+			uring_reap(l);
+		}
+		done = loader_take_done(l);
+	}
+#endif
+	if (!l->uring) {
+		pthread_mutex_lock(&l->lock);
+		while (wait && !l->done && l->pending > 0)
+			pthread_cond_wait(&l->done_cond, &l->lock);
+		done = loader_take_done(l);
+		pthread_mutex_unlock(&l->lock);
+	}
+
+	int n = 0;
+	while (done) {
+		load_req_t *next = done->next;
+		l->pending--;
+		n++;
+		stats_merge(&done->stats);
+		(*done->cb)(done->data, loader_adopt(l, done->str), done->error);
+		load_req_free(done);
+		done = next;
+	}
+
+#ifdef STR_HAVE_URING
+	// callbacks may have queued closes or new reads
+	if (l->uring)
+		uring_enter(l, 0);
+#endif
+	return n;
+}
+
+//-------------------------------------------------------------------------------
+// MSTR
+//-------------------------------------------------------------------------------
+
+static const int madvise_hints[] = {
+	MADV_NORMAL,
+	MADV_SEQUENTIAL,
+	MADV_RANDOM,
+	MADV_WILLNEED
+};
+
+//------------------------------------------------------------------------------
+
+mstr_t *mstr_from_file(const char *filename, int hint)
+{
+	assert(filename != 0);
+	assert(hint >= MSTR_NORMAL && hint <= MSTR_WILLNEED);
+
+	struct stat st;
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1)
+		return 0;
+	if (-1 == fstat(fd, &st)) {
+		close(fd);
+		return 0;
+	}
+
+	// if the file ends in the middle of a page, the rest of the page is
+	// zero-filled by the kernel, that's the zero termination, otherwise an
+	// anonymous mapping provides an extra zero page
+	size_t len = st.st_size;
+	size_t ps = page_size();
+	char *data;
+	size_t map_len;
+	if (len % ps != 0) {
+		map_len = len;
+		data = mmap(0, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	} else {
+		map_len = len + ps;
+		data = mmap(0, map_len, PROT_READ,
+			    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (data != MAP_FAILED && len > 0 &&
+		    MAP_FAILED == mmap(data, len, PROT_READ,
+				       MAP_PRIVATE | MAP_FIXED, fd, 0))
+		{
+			munmap(data, map_len);
+			data = MAP_FAILED;
+		}
+	}
+	close(fd);
+	if (data == MAP_FAILED)
+		return 0;
+
+	if (hint != MSTR_NORMAL && len > 0)
+		madvise(data, len, madvise_hints[hint]);
+
+	mstr_t *mstr = (*allocator.alloc)(allocator.ctx, sizeof(mstr_t));
+	mstr->len = len;
+	mstr->data = data;
+	mstr->map_len = map_len;
+	return mstr;
+}
+
+void mstr_free(mstr_t *mstr)
+{
+	assert(mstr != 0);
+
+	munmap((void*)mstr->data, mstr->map_len);
+	allocator_free(mstr, sizeof(mstr_t));
+}
+
+//-------------------------------------------------------------------------------
+// LREADER
+//-------------------------------------------------------------------------------
+
+typedef struct lreader_buf {
+	char *data;
+	int len;
+	int full;  // filled by the background thread, owned by the caller
+	int eof;
+	int error;
+} lreader_buf_t;
+
+struct lreader {
+	int fd;
+	int chunk_size;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int started;
+	int stop;
+
+	lreader_buf_t bufs[2];
+	lreader_buf_t *cur; // the chunk being parsed, zero if none
+	int ri;             // index of the next chunk to parse
+	int pos;            // parse position in 'cur'
+
+	// a line crossing a chunk boundary is collected here
+	str_t *carry;
+	int carry_done;
+};
+
+static void *lreader_thread(void *arg)
+{
+	lreader_t *r = arg;
+	int wi = 0;
+
+	for (;;) {
+		lreader_buf_t *b = &r->bufs[wi];
+
+		pthread_mutex_lock(&r->lock);
+		while (b->full && !r->stop)
+			pthread_cond_wait(&r->cond, &r->lock);
+		int stop = r->stop;
+		pthread_mutex_unlock(&r->lock);
+		if (stop)
+			break;
+
+		int len = 0, eof = 0, error = 0;
+		while (len < r->chunk_size) {
+			ssize_t n = read(r->fd, b->data + len, r->chunk_size - len);
+			if (n > 0) {
+				len += n;
+			} else if (n == 0) {
+				eof = 1;
+				break;
+			} else if (errno != EINTR) {
+				error = 1;
+				break;
+			}
+		}
+
+		pthread_mutex_lock(&r->lock);
+		b->len = len;
+		b->eof = eof;
+		b->error = error;
+		b->full = 1;
+		pthread_cond_broadcast(&r->cond);
+		pthread_mutex_unlock(&r->lock);
+
+		if (eof || error)
+			break;
+		wi ^= 1;
+	}
+	return 0;
+}
+
+// gives the current chunk back to the background thread
+static void lreader_release(lreader_t *r)
+{
+	pthread_mutex_lock(&r->lock);
+	r->cur->full = 0;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+	r->cur = 0;
+	r->ri ^= 1;
+}
+
+//------------------------------------------------------------------------------
+
+lreader_t *lreader_open(const char *filename, int chunk_size)
+{
+	assert(filename != 0);
+
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1)
+		return 0;
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	if (chunk_size <= 0)
+		chunk_size = LREADER_CHUNK_SIZE;
+
+	lreader_t *r = (*allocator.alloc)(allocator.ctx, sizeof(lreader_t));
+	memset(r, 0, sizeof(lreader_t));
+	r->fd = fd;
+	r->chunk_size = chunk_size;
+	for (int i = 0; i < 2; i++)
+		r->bufs[i].data = (*allocator.alloc)(allocator.ctx, chunk_size);
+	r->carry = str_new(0);
+	pthread_mutex_init(&r->lock, 0);
+	pthread_cond_init(&r->cond, 0);
+
+	if (pthread_create(&r->thread, 0, lreader_thread, r) != 0) {
+		lreader_close(r);
+		return 0;
+	}
+	r->started = 1;
+	return r;
+}
+
+void lreader_close(lreader_t *r)
+{
+	assert(r != 0);
+
+	if (r->started) {
+		pthread_mutex_lock(&r->lock);
+		r->stop = 1;
+		pthread_cond_broadcast(&r->cond);
+		pthread_mutex_unlock(&r->lock);
+		pthread_join(r->thread, 0);
+	}
+
+	close(r->fd);
+	pthread_mutex_destroy(&r->lock);
+	pthread_cond_destroy(&r->cond);
+	str_free(r->carry);
+	for (int i = 0; i < 2; i++)
+		allocator_free(r->bufs[i].data, r->chunk_size);
+	allocator_free(r, sizeof(lreader_t));
+}
+
+int lreader_next(lreader_t *r, const char **line, int *len)
+{
+	assert(r != 0);
+	assert(line != 0);
+	assert(len != 0);
+
+	if (r->carry_done) {
+		str_clear(r->carry);
+		r->carry_done = 0;
+	}
+
+	for (;;) {
+		if (!r->cur) {
+			lreader_buf_t *b = &r->bufs[r->ri];
+			pthread_mutex_lock(&r->lock);
+			while (!b->full)
+				pthread_cond_wait(&r->cond, &r->lock);
+			pthread_mutex_unlock(&r->lock);
+			if (b->error)
+				return -1;
+			r->cur = b;
+			r->pos = 0;
+		}
+
+		lreader_buf_t *b = r->cur;
+		char *start = b->data + r->pos;
+		char *nl = memchr(start, '\n', b->len - r->pos);
+		if (nl) {
+			r->pos = nl - b->data + 1;
+			if (r->carry->len == 0) {
+				*nl = '\0';
+				*line = start;
+				*len = nl - start;
+				return 1;
+			}
+			str_add_cstr_len(&r->carry, start, nl - start);
+			break;
+		}
+
+		str_add_cstr_len(&r->carry, start, b->len - r->pos);
+		int eof = b->eof;
+		if (eof) {
+			// don't give the last chunk back, the thread is done
+			r->pos = b->len;
+			if (r->carry->len == 0)
+				return 0;
+			break;
+		}
+		lreader_release(r);
+	}
+
+	*line = r->carry->data;
+	*len = r->carry->len;
+	r->carry_done = 1;
+	return 1;
+}
+
+//-------------------------------------------------------------------------------
+// TSTR
+//-------------------------------------------------------------------------------
+
+static int varint_size(int len)
+{
+	int n = 1;
+	while (len >= 0x80) {
+		len >>= 7;
+		n++;
+	}
+	return n;
+}
+
+//------------------------------------------------------------------------------
+
+tstr_t *tstr_from_cstr(const char *cstr)
+{
+	assert(cstr != 0);
+	return tstr_from_cstr_len(cstr, strlen(cstr));
+}
+
+tstr_t *tstr_from_cstr_len(const char *cstr, int len)
+{
+	assert(len >= 0);
+
+	unsigned char *p = (*allocator.alloc)(allocator.ctx,
+					      varint_size(len) + len + 1);
+	tstr_t *tstr = (tstr_t*)p;
+	int n = len;
+	while (n >= 0x80) {
+		*p++ = (n & 0x7F) | 0x80;
+		n >>= 7;
+	}
+	*p++ = n;
+	memcpy(p, cstr, len);
+	p[len] = '\0';
+	return tstr;
+}
+
+tstr_t *tstr_from_str(const str_t *str)
+{
+	assert(str != 0);
+	return tstr_from_cstr_len(str->data, str->len);
+}
+
+str_t *str_from_tstr(const tstr_t *tstr)
+{
+	assert(tstr != 0);
+	return str_from_cstr_len(tstr_data(tstr), tstr_len(tstr));
+}
+
+void tstr_free(tstr_t *tstr)
+{
+	int len = tstr_len(tstr);
+	allocator_free(tstr, varint_size(len) + len + 1);
+}
+
+//-------------------------------------------------------------------------------
+// FSTR
+//-------------------------------------------------------------------------------
+
+void fstr_add_cstr_len(fstr_t *fstr, const char *data, int len)
+{
+	if (!len)
+		return;
+
+	int avail = fstr->cap - fstr->len;
+	if (len > avail)
+		len = avail;
+
+	memcpy(&fstr->data[fstr->len], data, len);
+	fstr->data[fstr->len + len] = '\0';
+	fstr->len += len;
+}
+
+//------------------------------------------------------------------------------
+
+void fstr_init(fstr_t *fstr, char *data, int len, int cap)
+{
+	assert(fstr != 0);
+	assert(data != 0);
+	assert(cap >= len);
+	assert(cap > 0);
+
+	fstr->cap = cap;
+	fstr->len = len;
+	fstr->data = data;
+	fstr->data[0] = '\0';
+}
+
+void fstr_add_str(fstr_t *fstr, const str_t *str)
+{
+	assert(fstr != 0);
+	assert(str != 0);
+
+	fstr_add_cstr_len(fstr, str->data, str->len);
+}
+
+void fstr_add_cstr(fstr_t *fstr, const char *cstr)
+{
+	assert(fstr != 0);
+	assert(cstr != 0);
+
+	fstr_add_cstr_len(fstr, cstr, strlen(cstr));
+}
+
+void fstr_add_printf(fstr_t *fstr, const char *fmt, ...)
+{
+	assert(fstr != 0);
+	assert(fmt != 0);
+
+	va_list va;
+	int avail = fstr->cap - fstr->len;
+
+	va_start(va, fmt);
+	int len = vsnprintf(&fstr->data[fstr->len], avail+1, fmt, va);
+	va_end(va);
+
+	assert(len >= 0);
 	if (len > avail)
 		len = avail;
 	fstr->len += len;
 }
+
+void fstr_add_i64(fstr_t *fstr, int64_t v)
+{
+	assert(fstr != 0);
+
+	char buf[20];
+	char *p = i64_to_dec(buf + sizeof(buf), v);
+	fstr_add_cstr_len(fstr, p, buf + sizeof(buf) - p);
+}
+
+void fstr_add_u64(fstr_t *fstr, uint64_t v)
+{
+	assert(fstr != 0);
+
+	char buf[20];
+	char *p = u64_to_dec(buf + sizeof(buf), v);
+	fstr_add_cstr_len(fstr, p, buf + sizeof(buf) - p);
+}
+
+void fstr_add_hex(fstr_t *fstr, uint64_t v)
+{
+	assert(fstr != 0);
+
+	char buf[16];
+	char *p = u64_to_hex(buf + sizeof(buf), v);
+	fstr_add_cstr_len(fstr, p, buf + sizeof(buf) - p);
+}
+
+void fstr_add_double(fstr_t *fstr, double v)
+{
+	assert(fstr != 0);
+
+	char buf[32];
+	fstr_add_cstr_len(fstr, buf, double_to_str(buf, v));
+}
+
+//-------------------------------------------------------------------------------
+// ISTR
+//-------------------------------------------------------------------------------
+
+static void istr_reset(istr_t *istr)
+{
+	istr->cap = istr->buf_cap;
+	istr->len = 0;
+	istr->data = istr->buf;
+	istr->data[0] = '\0';
+	istr->heap = 0;
+}
+
+//------------------------------------------------------------------------------
+
+void istr_init(istr_t *istr, char *buf, int cap)
+{
+	assert(istr != 0);
+	assert(buf != 0);
+	assert(cap > 0);
+
+	istr->buf = buf;
+	istr->buf_cap = cap;
+	istr_reset(istr);
+}
+
+void istr_free(istr_t *istr)
+{
+	assert(istr != 0);
+
+	if (istr->heap)
+		str_free(istr->heap);
+	istr_reset(istr);
+}
+
+void istr_clear(istr_t *istr)
+{
+	assert(istr != 0);
+
+	istr->len = 0;
+	istr->data[0] = '\0';
+	if (istr->heap)
+		str_clear(istr->heap);
+}
+
+str_t *istr_to_str(istr_t *istr)
+{
+	assert(istr != 0);
+
+	str_t *str = istr->heap;
+	if (!str)
+		str = str_from_cstr_len(istr->data, istr->len);
+	istr_reset(istr);
+	return str;
+}
+
+void istr_ensure_cap(istr_t *istr, int n)
+{
+	assert(istr != 0);
+
+	if (istr->cap - istr->len >= n)
+		return;
+
+	if (istr->heap) {
+		str_ensure_cap(&istr->heap, n);
+	} else {
+		int cap = istr->cap * 2;
+		if (cap - istr->len < n)
+			cap = istr->len + n;
+		istr->heap = str_new(cap);
+		istr->heap->len = istr->len;
+		memcpy(istr->heap->data, istr->data, istr->len + 1);
+	}
+	istr->cap = istr->heap->cap;
+	istr->data = istr->heap->data;
+}
+
+void istr_add_str(istr_t *istr, const str_t *str)
+{
+	assert(istr != 0);
+	assert(str != 0);
+
+	istr_add_cstr_len(istr, str->data, str->len);
+}
+
+void istr_add_cstr(istr_t *istr, const char *cstr)
+{
+	assert(istr != 0);
+	assert(cstr != 0);
+
+	istr_add_cstr_len(istr, cstr, strlen(cstr));
+}
+
+void istr_add_cstr_len(istr_t *istr, const char *data, int len)
+{
+	if (len <= 0)
+		return;
+
+	istr_ensure_cap(istr, len);
+	memcpy(&istr->data[istr->len], data, len);
+	istr->len += len;
+	istr->data[istr->len] = '\0';
+	if (istr->heap)
+		istr->heap->len = istr->len;
+}
+
+void istr_add_printf(istr_t *istr, const char *fmt, ...)
+{
+	assert(istr != 0);
+	assert(fmt != 0);
+
+	va_list va;
+	int avail = istr->cap - istr->len;
+
+	// usually it fits and one pass is enough
+	va_start(va, fmt);
+	int len = vsnprintf(&istr->data[istr->len], avail + 1, fmt, va);
+	va_end(va);
+	assert(len >= 0);
+
+	if (len > avail) {
+		istr->data[istr->len] = '\0';
+		STAT_ADD(printf_double_passes, 1);
+		istr_ensure_cap(istr, len);
+		va_start(va, fmt);
+		vsnprintf(&istr->data[istr->len], len + 1, fmt, va);
+		va_end(va);
+	}
+	istr->len += len;
+	if (istr->heap)
+		istr->heap->len = istr->len;
+}
+
+//-------------------------------------------------------------------------------
+// RSTR
+//-------------------------------------------------------------------------------
+
+struct rstr_chunk {
+	rstr_chunk_t *next;
+	int cap;
+	int len;
+	char data[]; // cap + 1 bytes, the extra one is for vsnprintf's zero
+};
+
+static size_t rstr_chunk_size(int cap)
+{
+	return sizeof(rstr_chunk_t) + cap + 1;
+}
+
+// appends a chunk with at least 'cap' bytes of capacity
+static rstr_chunk_t *rstr_new_chunk(rstr_t *rstr, int cap)
+{
+	size_t size = rstr_chunk_size(cap);
+	if (allocator.good_size)
+		size = (*allocator.good_size)(allocator.ctx, size);
+	rstr_chunk_t *c = (*allocator.alloc)(allocator.ctx, size);
+	c->next = 0;
+	c->cap = size - sizeof(rstr_chunk_t) - 1;
+	c->len = 0;
+	STAT_ADD(allocs, 1);
+	STAT_ADD(bytes_requested, size);
+
+	if (rstr->tail)
+		rstr->tail->next = c;
+	else
+		rstr->head = c;
+	rstr->tail = c;
+	return c;
+}
+
+//------------------------------------------------------------------------------
+
+void rstr_init(rstr_t *rstr, int chunk_size)
+{
+	assert(rstr != 0);
+	assert(chunk_size >= 0);
+
+	rstr->head = 0;
+	rstr->tail = 0;
+	rstr->len = 0;
+	rstr->chunk_size = chunk_size ? chunk_size : RSTR_CHUNK_SIZE;
+}
+
+void rstr_free(rstr_t *rstr)
+{
+	assert(rstr != 0);
+
+	rstr_chunk_t *c = rstr->head;
+	while (c) {
+		rstr_chunk_t *next = c->next;
+		allocator_free(c, rstr_chunk_size(c->cap));
+		STAT_ADD(frees, 1);
+		c = next;
+	}
+	rstr->head = 0;
+	rstr->tail = 0;
+	rstr->len = 0;
+}
+
+void rstr_clear(rstr_t *rstr)
+{
+	assert(rstr != 0);
+
+	// the first chunk is kept for reuse
+	rstr_chunk_t *head = rstr->head;
+	if (!head)
+		return;
+	rstr->head = head->next;
+	rstr_free(rstr);
+	head->next = 0;
+	head->len = 0;
+	rstr->head = head;
+	rstr->tail = head;
+}
+
+str_t *rstr_to_str(const rstr_t *rstr)
+{
+	assert(rstr != 0);
+
+	if (rstr->len > INT_MAX) {
+		errno = EFBIG;
+		return 0;
+	}
+	str_t *str = str_new(rstr->len);
+	for (const rstr_chunk_t *c = rstr->head; c; c = c->next) {
+		memcpy(str->data + str->len, c->data, c->len);
+		str->len += c->len;
+	}
+	str->data[str->len] = '\0';
+	return str;
+}
+
+int rstr_write_fd(const rstr_t *rstr, int fd)
+{
+	assert(rstr != 0);
+
+	iov_batch_t b;
+	b.fd = fd;
+	b.cnt = 0;
+	for (const rstr_chunk_t *c = rstr->head; c; c = c->next) {
+		if (iov_batch_add(&b, c->data, c->len) == -1)
+			return -1;
+	}
+	return iov_batch_flush(&b);
+}
+
+void rstr_add_str(rstr_t *rstr, const str_t *str)
+{
+	assert(rstr != 0);
+	assert(str != 0);
+
+	rstr_add_cstr_len(rstr, str->data, str->len);
+}
+
+void rstr_add_cstr(rstr_t *rstr, const char *cstr)
+{
+	assert(rstr != 0);
+	assert(cstr != 0);
+
+	rstr_add_cstr_len(rstr, cstr, strlen(cstr));
+}
+
+void rstr_add_cstr_len(rstr_t *rstr, const char *data, int len)
+{
+	assert(rstr != 0);
+
+	rstr->len += len > 0 ? len : 0;
+	while (len > 0) {
+		rstr_chunk_t *c = rstr->tail;
+		if (!c || c->len == c->cap)
+			c = rstr_new_chunk(rstr, rstr->chunk_size);
+
+		int n = c->cap - c->len;
+		if (n > len)
+			n = len;
+		memcpy(c->data + c->len, data, n);
+		c->len += n;
+		data += n;
+		len -= n;
+	}
+}
+
+void rstr_add_printf(rstr_t *rstr, const char *fmt, ...)
+{
+	assert(rstr != 0);
+	assert(fmt != 0);
+
+	va_list va;
+	rstr_chunk_t *c = rstr->tail;
+	int avail = c ? c->cap - c->len : 0;
+
+	// usually it fits into the last chunk and one pass is enough
+	va_start(va, fmt);
+	int len = vsnprintf(c ? c->data + c->len : 0, c ? avail + 1 : 0,
+			    fmt, va);
+	va_end(va);
+	assert(len >= 0);
+	if (len == 0)
+		return;
+
+	if (len > avail) {
+		// the output is never split, the rest of the last chunk stays
+		// unused, a chunk is bigger than usual if the output is
+		c = rstr_new_chunk(rstr, len > rstr->chunk_size ?
+				   len : rstr->chunk_size);
+		va_start(va, fmt);
+		vsnprintf(c->data, len + 1, fmt, va);
+		va_end(va);
+		STAT_ADD(printf_double_passes, 1);
+	}
+	c->len += len;
+	rstr->len += len;
+}
+
+//-------------------------------------------------------------------------------
+// SPACK
+//-------------------------------------------------------------------------------
+
+// The archive layout, all integers are in the native byte order:
+//
+// +--------+---------------------+-------+--------------------------------+
+// | header | entries (sorted by  | paths | payloads, each zero-terminated |
+// |        | path, 24 bytes each)|       | and padded to 8 bytes          |
+// +--------+---------------------+-------+--------------------------------+
+//
+// Offsets are from the beginning of the file, paths are zero-terminated too.
+#define SPACK_MAGIC "STRPACK"
+#define SPACK_VERSION 1
+
+typedef struct spack_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t count;
+} spack_header_t;
+
+typedef struct spack_entry {
+	uint64_t path_off;
+	uint64_t data_off;
+	uint32_t path_len;
+	uint32_t data_len;
+} spack_entry_t;
+
+struct spack {
+	mstr_t *m;
+	const spack_entry_t *entries;
+	int count;
+};
+
+typedef struct spack_item {
+	const char *path;
+	int path_len;
+	const str_t *str;
+} spack_item_t;
+
+static int spack_cmp(const char *a, int alen, const char *b, int blen)
+{
+	int r = memcmp(a, b, alen < blen ? alen : blen);
+	if (r != 0)
+		return r;
+	return alen < blen ? -1 : alen > blen;
+}
+
+static int spack_item_cmp(const void *a, const void *b)
+{
+	const spack_item_t *ia = a, *ib = b;
+	return spack_cmp(ia->path, ia->path_len, ib->path, ib->path_len);
+}
+
+// appends paths of regular files under 'prefix' (a directory relative to
+// 'dirfd', empty or ending with a slash) to 'paths', recursively
+static int spack_walk(int dirfd, str_t **prefix, str_t ***paths, int *n,
+		      int *cap)
+{
+	int fd = openat(dirfd, (*prefix)->len ? (*prefix)->data : ".",
+			O_RDONLY | O_DIRECTORY);
+	if (fd == -1)
+		return -1;
+	DIR *d = fdopendir(fd);
+	if (!d) {
+		close(fd);
+		return -1;
+	}
+
+	int plen = (*prefix)->len;
+	int ret = 0;
+	struct dirent *e;
+	while ((e = readdir(d))) {
+		if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, ".."))
+			continue;
+
+		str_add_cstr(prefix, e->d_name);
+		struct stat st;
+		if (fstatat(dirfd, (*prefix)->data, &st,
+			    AT_SYMLINK_NOFOLLOW) == -1)
+		{
+			ret = -1;
+			break;
+		}
+		if (S_ISDIR(st.st_mode)) {
+			str_add_cstr(prefix, "/");
+			if (spack_walk(dirfd, prefix, paths, n, cap) == -1) {
+				ret = -1;
+				break;
+			}
+		} else if (S_ISREG(st.st_mode)) {
+			if (*n == *cap) {
+				int newcap = *cap ? *cap * 2 : 64;
+				*paths = allocator_resize(*paths,
+							  sizeof(str_t*) * *cap,
+							  sizeof(str_t*) * newcap);
+				*cap = newcap;
+			}
+			(*paths)[(*n)++] = str_dup(*prefix);
+		}
+		(*prefix)->len = plen;
+		(*prefix)->data[plen] = '\0';
+	}
+
+	int err = errno;
+	closedir(d);
+	(*prefix)->len = plen;
+	(*prefix)->data[plen] = '\0';
+	errno = err;
+	return ret;
+}
+
+//------------------------------------------------------------------------------
+
+int spack_write(const char *filename, const char *const *paths,
+		const str_t *const *strs, int n)
+{
+	assert(filename != 0);
+	assert(n >= 0);
+	assert(n == 0 || (paths != 0 && strs != 0));
+
+	size_t items_size = sizeof(spack_item_t) * (n ? n : 1);
+	spack_item_t *items = (*allocator.alloc)(allocator.ctx, items_size);
+	for (int i = 0; i < n; i++) {
+		items[i].path = paths[i];
+		items[i].path_len = strlen(paths[i]);
+		items[i].str = strs[i];
+	}
+	qsort(items, n, sizeof(spack_item_t), spack_item_cmp);
+	for (int i = 1; i < n; i++) {
+		if (spack_item_cmp(&items[i-1], &items[i]) == 0) {
+			allocator_free(items, items_size);
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	// header + entries + paths in one str, then the payloads followed
+	// by padding, which is one of the 8 tails of a zero block
+	size_t entries_size = sizeof(spack_entry_t) * n;
+	str_t *head = str_new(sizeof(spack_header_t) + entries_size);
+	spack_header_t h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, SPACK_MAGIC, sizeof(SPACK_MAGIC));
+	h.version = SPACK_VERSION;
+	h.count = n;
+	str_add_cstr_len(&head, (const char*)&h, sizeof(h));
+	head->len += entries_size;
+
+	spack_entry_t *entries = (*allocator.alloc)(allocator.ctx,
+						    entries_size + 1);
+	uint64_t off = sizeof(h) + entries_size;
+	for (int i = 0; i < n; i++) {
+		entries[i].path_off = off;
+		entries[i].path_len = items[i].path_len;
+		off += items[i].path_len + 1;
+		str_add_cstr_len(&head, items[i].path, items[i].path_len + 1);
+	}
+
+	str_t *pads[8];
+	for (int i = 0; i < 8; i++) {
+		pads[i] = str_new(8);
+		memset(pads[i]->data, 0, 8);
+		pads[i]->len = i + 1;
+	}
+
+	size_t parts_size = sizeof(str_t*) * (2 * n + 2);
+	const str_t **parts = (*allocator.alloc)(allocator.ctx, parts_size);
+	int nparts = 0;
+	parts[nparts++] = head;
+	int pad = align_up(off, 8) - off;
+	if (pad)
+		parts[nparts++] = pads[pad - 1];
+	off += pad;
+	for (int i = 0; i < n; i++) {
+		const str_t *s = items[i].str;
+		entries[i].data_off = off;
+		entries[i].data_len = s->len;
+		parts[nparts++] = s;
+		pad = align_up(s->len + 1, 8) - s->len;
+		parts[nparts++] = pads[pad - 1];
+		off += s->len + pad;
+	}
+	memcpy(head->data + sizeof(h), entries, entries_size);
+
+	int ret = str_writev_file(filename, parts, nparts);
+	int err = errno;
+	for (int i = 0; i < 8; i++)
+		str_free(pads[i]);
+	str_free(head);
+	allocator_free(parts, parts_size);
+	allocator_free(entries, entries_size + 1);
+	allocator_free(items, items_size);
+	errno = err;
+	return ret;
+}
+
+int spack_write_dir(const char *filename, int dirfd, const char *dir)
+{
+	assert(filename != 0);
+	assert(dir != 0);
+
+	int top = openat(dirfd, dir, O_RDONLY | O_DIRECTORY);
+	if (top == -1)
+		return -1;
+
+	str_t **paths = 0;
+	int n = 0, cap = 0;
+	str_t *prefix = str_new(0);
+	int ret = spack_walk(top, &prefix, &paths, &n, &cap);
+	str_free(prefix);
+
+	int m = n ? n : 1;
+	const char **cpaths = (*allocator.alloc)(allocator.ctx,
+						 sizeof(char*) * m);
+	str_t **strs = (*allocator.alloc)(allocator.ctx, sizeof(str_t*) * m);
+	int *errors = (*allocator.alloc)(allocator.ctx, sizeof(int) * m);
+	for (int i = 0; i < n; i++) {
+		cpaths[i] = paths[i]->data;
+		strs[i] = 0;
+	}
+	if (ret == 0 && str_from_files(top, cpaths, n, strs, errors, 0) != 0) {
+		for (int i = 0; i < n; i++) {
+			if (errors[i]) {
+				errno = errors[i];
+				break;
+			}
+		}
+		ret = -1;
+	}
+	if (ret == 0)
+		ret = spack_write(filename, cpaths, (const str_t *const *)strs,
+				  n);
+
+	int err = errno;
+	for (int i = 0; i < n; i++) {
+		if (strs[i])
+			str_free(strs[i]);
+	}
+	allocator_free(errors, sizeof(int) * m);
+	allocator_free(strs, sizeof(str_t*) * m);
+	for (int i = 0; i < n; i++)
+		str_free(paths[i]);
+	if (paths)
+		allocator_free(paths, sizeof(str_t*) * cap);
+	allocator_free(cpaths, sizeof(char*) * m);
+	close(top);
+	errno = err;
+	return ret;
+}
+
+spack_t *spack_open(const char *filename)
+{
+	assert(filename != 0);
+
+	mstr_t *m = mstr_from_file(filename, MSTR_RANDOM);
+	if (!m)
+		return 0;
+
+	// everything is validated once here, lookups trust the index
+	const spack_header_t *h = (const spack_header_t*)m->data;
+	if (m->len < sizeof(spack_header_t) ||
+	    memcmp(h->magic, SPACK_MAGIC, sizeof(SPACK_MAGIC)) != 0 ||
+	    h->version != SPACK_VERSION || h->count > INT_MAX ||
+	    (m->len - sizeof(spack_header_t)) / sizeof(spack_entry_t) <
+	    h->count)
+		goto invalid;
+
+	const spack_entry_t *entries = (const spack_entry_t*)(h + 1);
+	for (uint32_t i = 0; i < h->count; i++) {
+		const spack_entry_t *e = &entries[i];
+		if (e->path_off >= m->len || m->len - e->path_off <=
+		    e->path_len || m->data[e->path_off + e->path_len] != '\0')
+			goto invalid;
+		if (e->data_off % 8 != 0 || e->data_off >= m->len ||
+		    m->len - e->data_off <= e->data_len ||
+		    e->data_len > INT_MAX ||
+		    m->data[e->data_off + e->data_len] != '\0')
+			goto invalid;
+		if (i > 0 && spack_cmp(m->data + e[-1].path_off, e[-1].path_len,
+				       m->data + e->path_off,
+				       e->path_len) >= 0)
+			goto invalid;
+	}
+
+	spack_t *p = (*allocator.alloc)(allocator.ctx, sizeof(spack_t));
+	p->m = m;
+	p->entries = entries;
+	p->count = h->count;
+	return p;
+
+invalid:
+	mstr_free(m);
+	errno = EINVAL;
+	return 0;
+}
+
+void spack_close(spack_t *p)
+{
+	assert(p != 0);
+
+	mstr_free(p->m);
+	allocator_free(p, sizeof(spack_t));
+}
+
+int spack_count(const spack_t *p)
+{
+	assert(p != 0);
+	return p->count;
+}
+
+const char *spack_get(const spack_t *p, int i, const char **path, int *len)
+{
+	assert(p != 0);
+	assert(i >= 0 && i < p->count);
+
+	const spack_entry_t *e = &p->entries[i];
+	if (path)
+		*path = p->m->data + e->path_off;
+	if (len)
+		*len = e->data_len;
+	return p->m->data + e->data_off;
+}
+
+const char *spack_find(const spack_t *p, const char *path, int *len)
+{
+	assert(p != 0);
+	assert(path != 0);
+
+	int path_len = strlen(path);
+	int lo = 0, hi = p->count;
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		const spack_entry_t *e = &p->entries[mid];
+		int r = spack_cmp(p->m->data + e->path_off, e->path_len,
+				  path, path_len);
+		if (r == 0)
+			return spack_get(p, mid, 0, len);
+		if (r < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return 0;
+}
+
+//-------------------------------------------------------------------------------
+// LSTR
+//-------------------------------------------------------------------------------
+
+#define LSTR_MAX_CAP (SSIZE_MAX - sizeof(lstr_t) - 1)
+
+static size_t lstr_size(size_t cap)
+{
+	size_t size = sizeof(lstr_t) + cap + 1;
+	if (allocator.good_size)
+		size = (*allocator.good_size)(allocator.ctx, size);
+	return size;
+}
+
+static lstr_t *alloc_lstr(size_t cap)
+{
+	if (cap > LSTR_MAX_CAP)
+		length_overflow();
+	size_t size = lstr_size(cap);
+	lstr_t *str = (*allocator.alloc)(allocator.ctx, size);
+	str->cap = size - sizeof(lstr_t) - 1;
+	STAT_ADD(allocs, 1);
+	STAT_ADD(bytes_requested, size);
+	return str;
+}
+
+// same as next_cap, doubling saturates at LSTR_MAX_CAP
+static size_t next_lcap(size_t cap, size_t len, size_t n)
+{
+	if (n > LSTR_MAX_CAP - len)
+		length_overflow();
+	size_t newcap = cap > LSTR_MAX_CAP / 2 ? LSTR_MAX_CAP : cap * 2;
+	if (newcap - len < n)
+		newcap = len + n;
+	return newcap;
+}
+
+static char *lstr_read_reserve(void *str, size_t len, size_t n, size_t *cap)
+{
+	lstr_t **s = str;
+	(*s)->len = len;
+	lstr_ensure_cap(s, n);
+	*cap = (*s)->cap;
+	return (*s)->data;
+}
+
+// same as read_fd, but for a lstr, a single read returns at most about 2GB
+// on linux, so big files take several reads even if the size is known
+static ssize_t lstr_read_fd(lstr_t **str, int fd, ssize_t size)
+{
+	size_t start = (*str)->len;
+	ssize_t n = read_fd_loop(str, lstr_read_reserve, start, LSTR_MAX_CAP,
+				 fd, size);
+	(*str)->len = n < 0 ? start : start + n;
+	(*str)->data[(*str)->len] = '\0';
+	return n;
+}
+
+//------------------------------------------------------------------------------
+
+lstr_t *lstr_new(size_t cap)
+{
+	if (cap == 0)
+		cap = STR_DEFAULT_CAPACITY;
+	lstr_t *str = alloc_lstr(cap);
+	str->len = 0;
+	str->data[0] = '\0';
+	return str;
+}
+
+lstr_t *lstr_from_file(const char *filename)
+{
+	assert(filename != 0);
+
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1)
+		return 0;
+	lstr_t *str = lstr_from_fd(fd);
+	int err = errno;
+	close(fd);
+	errno = err;
+	return str;
+}
+
+lstr_t *lstr_from_fd(int fd)
+{
+	ssize_t size = fd_size_hint(fd, LSTR_MAX_CAP);
+	if (size < 0)
+		return 0;
+
+	lstr_t *str = lstr_new(size);
+	if (-1 == lstr_read_fd(&str, fd, size)) {
+		int err = errno;
+		lstr_free(str);
+		errno = err;
+		return 0;
+	}
+	return str;
+}
+
+void lstr_free(lstr_t *str)
+{
+	assert(str != 0);
+
+	allocator_free(str, sizeof(lstr_t) + str->cap + 1);
+	STAT_ADD(frees, 1);
+}
+
+void lstr_clear(lstr_t *str)
+{
+	assert(str != 0);
+
+	str->len = 0;
+	str->data[0] = '\0';
+}
+
+void lstr_ensure_cap(lstr_t **out_str, size_t n)
+{
+	assert(out_str != 0);
+	assert(*out_str != 0);
+
+	lstr_t *str = *out_str;
+	if (str->cap - str->len >= n)
+		return;
+
+	size_t newcap = next_lcap(str->cap, str->len, n);
+	size_t old_size = sizeof(lstr_t) + str->cap + 1;
+	STAT_ADD(regrows, 1);
+	if (can_resize(str, old_size)) {
+		size_t size = lstr_size(newcap);
+		str = (*allocator.resize)(allocator.ctx, str, old_size, size);
+		str->cap = size - sizeof(lstr_t) - 1;
+		STAT_ADD(bytes_requested, size - old_size);
+		if (str != *out_str)
+			STAT_ADD(regrow_bytes_copied, str->len + 1);
+		*out_str = str;
+		return;
+	}
+
+	STAT_ADD(regrow_bytes_copied, str->len + 1);
+	lstr_t *newstr = alloc_lstr(newcap);
+	newstr->len = str->len;
+	memcpy(newstr->data, str->data, str->len + 1);
+	allocator_free(str, old_size);
+	STAT_ADD(frees, 1);
+	*out_str = newstr;
+}
+
+void lstr_add_str(lstr_t **str, const str_t *str2)
+{
+	assert(str2 != 0);
+	lstr_add_cstr_len(str, str2->data, str2->len);
+}
+
+void lstr_add_lstr(lstr_t **str, const lstr_t *str2)
+{
+	assert(str2 != 0);
+	assert(str2 != *str);
+	lstr_add_cstr_len(str, str2->data, str2->len);
+}
+
+void lstr_add_cstr(lstr_t **str, const char *cstr)
+{
+	assert(cstr != 0);
+	assert(cstr < (*str)->data || cstr > (*str)->data + (*str)->cap);
+	lstr_add_cstr_len(str, cstr, strlen(cstr));
+}
+
+void lstr_add_cstr_len(lstr_t **str, const char *data, size_t len)
+{
+	assert(str != 0);
+	assert(*str != 0);
+
+	if (len == 0)
+		return;
+
+	lstr_ensure_cap(str, len);
+	lstr_t *s = *str;
+	memcpy(s->data + s->len, data, len);
+	s->len += len;
+	s->data[s->len] = '\0';
+}
+
+void lstr_add_printf(lstr_t **str, const char *fmt, ...)
+{
+	assert(str != 0);
+	assert(*str != 0);
+	assert(fmt != 0);
+
+	va_list va;
+	lstr_t *s = *str;
+	size_t avail = s->cap - s->len;
+
+	// usually it fits and one pass is enough
+	va_start(va, fmt);
+	int len = vsnprintf(s->data + s->len,
+			    avail < INT_MAX ? avail + 1 : INT_MAX, fmt, va);
+	va_end(va);
+	assert(len >= 0);
+
+	if ((size_t)len > avail) {
+		s->data[s->len] = '\0';
+		lstr_ensure_cap(str, len);
+		s = *str;
+		va_start(va, fmt);
+		vsnprintf(s->data + s->len, len + 1, fmt, va);
+		va_end(va);
+		STAT_ADD(printf_double_passes, 1);
+	}
+	s->len += len;
+}
+
+ptrdiff_t lstr_add_fd(lstr_t **str, int fd)
+{
+	assert(str != 0);
+	assert(*str != 0);
+
+	ssize_t size = fd_size_hint(fd, LSTR_MAX_CAP - (*str)->len);
+	if (size < 0)
+		return -1;
+	return lstr_read_fd(str, fd, size);
+}
+
+int lstr_write_fd(int fd, const lstr_t *str)
+{
+	assert(str != 0);
+
+	struct iovec iov;
+	iov.iov_base = (void*)str->data;
+	iov.iov_len = str->len;
+	return writev_all(fd, &iov, str->len ? 1 : 0);
+}
+
+//-------------------------------------------------------------------------------
+// LINDEX
+//-------------------------------------------------------------------------------
+
+// a newline at 'pos', the next line starts right after it
+static void lindex_newline(lindex_t *idx, size_t pos)
+{
+	idx->newlines++;
+	idx->last = pos + 1;
+	if (idx->newlines % LINDEX_SAMPLE != 0)
+		return;
+
+	if (idx->nsamples == idx->samples_cap) {
+		size_t size = sizeof(size_t) * idx->samples_cap;
+		idx->samples = allocator_resize(idx->samples, size, size * 2);
+		idx->samples_cap *= 2;
+	}
+	idx->samples[idx->nsamples++] = pos + 1;
+}
+
+// returns the position right after the k-th newline from 'p', which must exist
+static const char *lindex_skip(const char *p, const char *end, size_t k)
+{
+#ifdef __SSE2__
+	const __m128i nl = _mm_set1_epi8('\n');
+	for (; k > 0 && end - p >= 16; p += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)p);
+		unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+		unsigned n = __builtin_popcount(mask);
+		if (n < k) {
+			k -= n;
+			continue;
+		}
+		while (--k > 0)
+			mask &= mask - 1;
+		return p + __builtin_ctz(mask) + 1;
+	}
+#endif
+	for (; k > 0; k--)
+		p = (const char*)memchr(p, '\n', end - p) + 1;
+	return p;
+}
+
+//------------------------------------------------------------------------------
+
+void lindex_init(lindex_t *idx)
+{
+	assert(idx != 0);
+
+	idx->samples_cap = 16;
+	idx->samples = (*allocator.alloc)(allocator.ctx,
+					  sizeof(size_t) * idx->samples_cap);
+	idx->samples[0] = 0;
+	idx->nsamples = 1;
+	idx->newlines = 0;
+	idx->last = 0;
+	idx->scanned = 0;
+}
+
+void lindex_free(lindex_t *idx)
+{
+	assert(idx != 0);
+
+	allocator_free(idx->samples, sizeof(size_t) * idx->samples_cap);
+	idx->samples = 0;
+}
+
+void lindex_update(lindex_t *idx, const char *data, size_t len)
+{
+	assert(idx != 0);
+	assert(data != 0 || len == 0);
+	assert(len >= idx->scanned);
+
+	size_t i = idx->scanned;
+#ifdef __SSE2__
+	// 16 bytes at a time, newlines are only visited one by one when a
+	// sample falls into the block
+	const __m128i nl = _mm_set1_epi8('\n');
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+		unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+		if (!mask)
+			continue;
+
+		unsigned n = __builtin_popcount(mask);
+		if (idx->newlines % LINDEX_SAMPLE + n < LINDEX_SAMPLE) {
+			idx->newlines += n;
+			idx->last = i + 32 - __builtin_clz(mask);
+			continue;
+		}
+		while (mask) {
+			lindex_newline(idx, i + __builtin_ctz(mask));
+			mask &= mask - 1;
+		}
+	}
+#endif
+	while (i < len) {
+		const char *nl = memchr(data + i, '\n', len - i);
+		if (!nl)
+			break;
+		lindex_newline(idx, nl - data);
+		i = nl - data + 1;
+	}
+	idx->scanned = len;
+}
+
+size_t lindex_lines(const lindex_t *idx)
+{
+	assert(idx != 0);
+
+	// the last line doesn't need a newline unless it's empty
+	return idx->newlines + (idx->scanned > idx->last);
+}
+
+int lindex_line(const lindex_t *idx, const char *data, size_t n,
+		const char **line, size_t *len)
+{
+	assert(idx != 0);
+	assert(data != 0);
+
+	if (n >= lindex_lines(idx))
+		return 0;
+
+	const char *end = data + idx->scanned;
+	const char *p = data + idx->samples[n / LINDEX_SAMPLE];
+	p = lindex_skip(p, end, n % LINDEX_SAMPLE);
+
+	const char *nl = memchr(p, '\n', end - p);
+	if (line)
+		*line = p;
+	if (len)
+		*len = (nl ? nl : end) - p;
+	return 1;
+}
+
+//-------------------------------------------------------------------------------
+// STRVIEW
+//-------------------------------------------------------------------------------
+
+str_t *str_from_strview(strview_t v)
+{
+	assert(v.len <= INT_MAX);
+	return str_from_cstr_len(v.data, v.len);
+}
+
+void str_add_strview(str_t **str, strview_t v)
+{
+	assert(v.len <= INT_MAX);
+	str_add_cstr_len(str, v.data, v.len);
+}
+
+int strview_eq(strview_t a, strview_t b)
+{
+	return a.len == b.len && memcmp(a.data, b.data, a.len) == 0;
+}
+
+int strview_cmp(strview_t a, strview_t b)
+{
+	int r = memcmp(a.data, b.data, a.len < b.len ? a.len : b.len);
+	if (r != 0)
+		return r;
+	return a.len < b.len ? -1 : a.len > b.len;
+}
+
+strview_t strview_trim(strview_t v)
+{
+	return strview_ltrim(strview_rtrim(v));
+}
+
+strview_t strview_ltrim(strview_t v)
+{
+	while (v.len > 0 && isspace((unsigned char)*v.data)) {
+		v.data++;
+		v.len--;
+	}
+	return v;
+}
+
+strview_t strview_rtrim(strview_t v)
+{
+	while (v.len > 0 && isspace((unsigned char)v.data[v.len - 1]))
+		v.len--;
+	return v;
+}
+
+strview_t strview_trim_ascii(strview_t v)
+{
+	size_t n = ascii_space_prefix(v.data, v.len);
+	v.data += n;
+	v.len -= n;
+	v.len -= ascii_space_suffix(v.data, v.len);
+	return v;
+}
+
+ptrdiff_t strview_find(strview_t v, strview_t needle)
+{
+	return str_find_mem(v.data, v.len, needle.data, needle.len);
+}
+
+ptrdiff_t strview_rfind(strview_t v, strview_t needle)
+{
+	return str_rfind_mem(v.data, v.len, needle.data, needle.len);
+}
+
+ptrdiff_t strview_find_char(strview_t v, char c)
+{
+	return str_find_char_mem(v.data, v.len, c);
+}
+
+int strview_split(strview_t v, char sep, strview_t *head, strview_t *tail)
+{
+	ptrdiff_t i = strview_find_char(v, sep);
+	if (i == -1) {
+		if (head)
+			*head = v;
+		if (tail)
+			*tail = strview(v.data + v.len, 0);
+		return 0;
+	}
+	if (head)
+		*head = strview(v.data, i);
+	if (tail)
+		*tail = strview(v.data + i + 1, v.len - i - 1);
+	return 1;
+}
+
+int strview_next_token(strview_t *rest, const char *delims, strview_t *token)
+{
+	assert(rest != 0);
+	assert(delims != 0);
+
+	unsigned char set[32];
+	memset(set, 0, sizeof(set));
+	for (const unsigned char *d = (const unsigned char*)delims; *d; d++)
+		set[*d >> 3] |= 1 << (*d & 7);
+
+#define IS_DELIM(c) (set[(unsigned char)(c) >> 3] & (1 << ((c) & 7)))
+	const char *p = rest->data, *end = rest->data + rest->len;
+	while (p != end && IS_DELIM(*p))
+		p++;
+	const char *start = p;
+	while (p != end && !IS_DELIM(*p))
+		p++;
+#undef IS_DELIM
+
+	*rest = strview(p, end - p);
+	if (start == p)
+		return 0;
+	if (token)
+		*token = strview(start, p - start);
+	return 1;
+}
+
+int strview_split_path(strview_t path, strview_t *dir, strview_t *file)
+{
+	// a slash at the very beginning doesn't count, like in str_split_path
+	size_t i = path.len;
+	while (i > 1 && path.data[i - 1] != '/')
+		i--;
+
+	if (i <= 1) {
+		if (file)
+			*file = path;
+		return 0;
+	}
+	if (dir)
+		*dir = strview(path.data, i - 1);
+	if (file)
+		*file = strview(path.data + i, path.len - i);
+	return 1;
+}
+
+//-------------------------------------------------------------------------------
+// SEARCH
+//-------------------------------------------------------------------------------
+
+// Two-Way string matching (Crochemore, Perrin), linear time, constant space.
+// With 'rev' both strings are read backwards, which finds the last
+// occurrence, the offset is then counted from the end of 'y' to the end of
+// the occurrence.
+#define TW_AT(s, len, i) (rev ? (s)[(len) - 1 - (i)] : (s)[i])
+
+// the maximal suffix of 'x' for '<' or, with 'tilde', for '>'
+static ptrdiff_t tw_max_suffix(const unsigned char *x, ptrdiff_t m, int rev,
+			       int tilde, ptrdiff_t *period)
+{
+	ptrdiff_t ms = -1, j = 0, k = 1, p = 1;
+	while (j + k < m) {
+		unsigned char a = TW_AT(x, m, j + k);
+		unsigned char b = TW_AT(x, m, ms + k);
+		if (tilde ? a > b : a < b) {
+			j += k;
+			k = 1;
+			p = j - ms;
+		} else if (a == b) {
+			if (k != p) {
+				k++;
+			} else {
+				j += p;
+				k = 1;
+			}
+		} else {
+			ms = j;
+			j = ms + 1;
+			k = p = 1;
+		}
+	}
+	*period = p;
+	return ms;
+}
+
+static ptrdiff_t two_way(const unsigned char *y, ptrdiff_t n,
+			 const unsigned char *x, ptrdiff_t m, int rev)
+{
+	// the critical factorization: x = x[0..ell] x[ell+1..m)
+	ptrdiff_t p, q;
+	ptrdiff_t i = tw_max_suffix(x, m, rev, 0, &p);
+	ptrdiff_t j = tw_max_suffix(x, m, rev, 1, &q);
+	ptrdiff_t ell = i > j ? i : j;
+	ptrdiff_t per = i > j ? p : q;
+
+	int periodic = 1;
+	for (i = 0; i <= ell; i++) {
+		if (TW_AT(x, m, i) != TW_AT(x, m, i + per)) {
+			periodic = 0;
+			break;
+		}
+	}
+
+	if (periodic) {
+		// the prefix matched by the previous attempt is remembered
+		ptrdiff_t memory = -1;
+		for (j = 0; j <= n - m;) {
+			i = (ell > memory ? ell : memory) + 1;
+			while (i < m && TW_AT(x, m, i) == TW_AT(y, n, i + j))
+				i++;
+			if (i < m) {
+				j += i - ell;
+				memory = -1;
+				continue;
+			}
+			i = ell;
+			while (i > memory && TW_AT(x, m, i) == TW_AT(y, n, i + j))
+				i--;
+			if (i <= memory)
+				return j;
+			j += per;
+			memory = m - per - 1;
+		}
+	} else {
+		per = (ell + 1 > m - ell - 1 ? ell + 1 : m - ell - 1) + 1;
+		for (j = 0; j <= n - m;) {
+			i = ell + 1;
+			while (i < m && TW_AT(x, m, i) == TW_AT(y, n, i + j))
+				i++;
+			if (i < m) {
+				j += i - ell;
+				continue;
+			}
+			i = ell;
+			while (i >= 0 && TW_AT(x, m, i) == TW_AT(y, n, i + j))
+				i--;
+			if (i < 0)
+				return j;
+			j += per;
+		}
+	}
+	return -1;
+}
+
+#undef TW_AT
+
+static ptrdiff_t two_way_rev(const unsigned char *y, size_t n,
+			     const unsigned char *x, size_t m)
+{
+	ptrdiff_t r = two_way(y, n, x, m, 1);
+	return r == -1 ? -1 : (ptrdiff_t)(n - m) - r;
+}
+
+// The SIMD filter compares the first and the last byte of the needle at
+// every position of a block at once, only the positions where both match
+// are verified with memcmp. On real text that's rare and it's a lot faster
+// than Two-Way, even for long needles. But a needle like "aaaba" in
+// "aaaa..." makes it quadratic, so verification has a budget proportional
+// to the haystack, when it's exhausted the rest is searched with Two-Way.
+#if defined(__AVX2__)
+#define FIND_BLOCK 32
+static unsigned find_mask(const unsigned char *p, size_t last_off,
+			  const unsigned char *needle)
+{
+	__m256i first = _mm256_set1_epi8(needle[0]);
+	__m256i last = _mm256_set1_epi8(needle[last_off]);
+	__m256i a = _mm256_loadu_si256((const __m256i*)p);
+	__m256i b = _mm256_loadu_si256((const __m256i*)(p + last_off));
+	return _mm256_movemask_epi8(_mm256_and_si256(
+		_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+}
+#elif defined(__SSE2__)
+#define FIND_BLOCK 16
+static unsigned find_mask(const unsigned char *p, size_t last_off,
+			  const unsigned char *needle)
+{
+	__m128i first = _mm_set1_epi8(needle[0]);
+	__m128i last = _mm_set1_epi8(needle[last_off]);
+	__m128i a = _mm_loadu_si128((const __m128i*)p);
+	__m128i b = _mm_loadu_si128((const __m128i*)(p + last_off));
+	return _mm_movemask_epi8(_mm_and_si128(
+		_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+}
+#endif
+
+#define FIND_BUDGET(hlen) ((hlen) + 4096)
+
+static int find_verify(const unsigned char *h, const unsigned char *n,
+		       size_t nlen)
+{
+	return h[0] == n[0] && h[nlen - 1] == n[nlen - 1] &&
+	       memcmp(h + 1, n + 1, nlen - 2) == 0;
+}
+
+// 2 <= nlen <= hlen
+static ptrdiff_t find_filter(const unsigned char *h, size_t hlen,
+			    const unsigned char *n, size_t nlen)
+{
+	size_t end = hlen - nlen + 1; // possible starts are [0, end)
+	size_t i = 0, work = 0;
+#ifdef FIND_BLOCK
+	for (; i + FIND_BLOCK <= end; i += FIND_BLOCK) {
+		unsigned mask = find_mask(h + i, nlen - 1, n);
+		while (mask) {
+			size_t s = i + __builtin_ctz(mask);
+			if (memcmp(h + s + 1, n + 1, nlen - 2) == 0)
+				return s;
+			work += nlen;
+			if (work > FIND_BUDGET(hlen)) {
+				ptrdiff_t r = two_way(h + s, hlen - s,
+						      n, nlen, 0);
+				return r == -1 ? -1 : (ptrdiff_t)s + r;
+			}
+			mask &= mask - 1;
+		}
+	}
+#endif
+	// less than a block is left
+	for (; i < end; i++) {
+		if (find_verify(h + i, n, nlen))
+			return i;
+	}
+	return -1;
+}
+
+// 2 <= nlen <= hlen
+static ptrdiff_t rfind_filter(const unsigned char *h, size_t hlen,
+			     const unsigned char *n, size_t nlen)
+{
+	size_t i = hlen - nlen + 1, work = 0;
+#ifdef FIND_BLOCK
+	for (; i >= FIND_BLOCK; i -= FIND_BLOCK) {
+		unsigned mask = find_mask(h + i - FIND_BLOCK, nlen - 1, n);
+		while (mask) {
+			int bit = 31 - __builtin_clz(mask);
+			size_t s = i - FIND_BLOCK + bit;
+			if (memcmp(h + s + 1, n + 1, nlen - 2) == 0)
+				return s;
+			work += nlen;
+			if (work > FIND_BUDGET(hlen))
+				return two_way_rev(h, s + nlen, n, nlen);
+			mask &= ~(1u << bit);
+		}
+	}
+#endif
+	while (i-- > 0) {
+		if (find_verify(h + i, n, nlen))
+			return i;
+	}
+	return -1;
+}
+
+// the last 'c', the filter with both ends of the needle at the same byte
+static ptrdiff_t rfind_char(const unsigned char *h, size_t hlen,
+			    unsigned char c)
+{
+	size_t i = hlen;
+#ifdef FIND_BLOCK
+	for (; i >= FIND_BLOCK; i -= FIND_BLOCK) {
+		unsigned mask = find_mask(h + i - FIND_BLOCK, 0, &c);
+		if (mask)
+			return i - FIND_BLOCK + 31 - __builtin_clz(mask);
+	}
+#endif
+	while (i-- > 0) {
+		if (h[i] == c)
+			return i;
+	}
+	return -1;
+}
+
+//------------------------------------------------------------------------------
+
+ptrdiff_t str_find_mem(const char *hay, size_t hlen, const char *needle,
+		       size_t nlen)
+{
+	assert(hay != 0 || hlen == 0);
+	assert(needle != 0 || nlen == 0);
+
+	const unsigned char *h = (const unsigned char*)hay;
+	const unsigned char *n = (const unsigned char*)needle;
+	if (nlen == 0)
+		return 0;
+	if (nlen > hlen)
+		return -1;
+	if (nlen == 1)
+		return str_find_char_mem(hay, hlen, needle[0]);
+	return find_filter(h, hlen, n, nlen);
+}
+
+ptrdiff_t str_rfind_mem(const char *hay, size_t hlen, const char *needle,
+			size_t nlen)
+{
+	assert(hay != 0 || hlen == 0);
+	assert(needle != 0 || nlen == 0);
+
+	const unsigned char *h = (const unsigned char*)hay;
+	const unsigned char *n = (const unsigned char*)needle;
+	if (nlen == 0)
+		return hlen;
+	if (nlen > hlen)
+		return -1;
+	if (nlen == 1)
+		return rfind_char(h, hlen, n[0]);
+	return rfind_filter(h, hlen, n, nlen);
+}
+
+ptrdiff_t str_find_char_mem(const char *hay, size_t hlen, char c)
+{
+	assert(hay != 0 || hlen == 0);
+
+	// libc's memchr is vectorized already
+	const char *p = memchr(hay, c, hlen);
+	return p ? p - hay : -1;
+}
+
+size_t str_count_mem(const char *hay, size_t hlen, const char *needle,
+		     size_t nlen)
+{
+	if (nlen == 0)
+		return 0;
+
+	size_t count = 0, off = 0;
+	for (;;) {
+		ptrdiff_t i = str_find_mem(hay + off, hlen - off, needle, nlen);
+		if (i == -1)
+			return count;
+		count++;
+		off += i + nlen;
+	}
+}
+
+int str_find(const str_t *str, const char *needle, int len)
+{
+	assert(str != 0);
+	return str_find_mem(str->data, str->len, needle, len);
+}
+
+int str_rfind(const str_t *str, const char *needle, int len)
+{
+	assert(str != 0);
+	return str_rfind_mem(str->data, str->len, needle, len);
+}
+
+int str_find_char(const str_t *str, char c)
+{
+	assert(str != 0);
+	return str_find_char_mem(str->data, str->len, c);
+}
+
+int str_count(const str_t *str, const char *needle, int len)
+{
+	assert(str != 0);
+	return str_count_mem(str->data, str->len, needle, len);
+}
+
+int fstr_find(const fstr_t *fstr, const char *needle, int len)
+{
+	assert(fstr != 0);
+	return str_find_mem(fstr->data, fstr->len, needle, len);
+}
+
+int fstr_rfind(const fstr_t *fstr, const char *needle, int len)
+{
+	assert(fstr != 0);
+	return str_rfind_mem(fstr->data, fstr->len, needle, len);
+}
+
+int fstr_find_char(const fstr_t *fstr, char c)
+{
+	assert(fstr != 0);
+	return str_find_char_mem(fstr->data, fstr->len, c);
+}
+
+int fstr_count(const fstr_t *fstr, const char *needle, int len)
+{
+	assert(fstr != 0);
+	return str_count_mem(fstr->data, fstr->len, needle, len);
+}
+
+//-------------------------------------------------------------------------------
+// ACM
+//-------------------------------------------------------------------------------
+
+typedef struct acm_state {
+	int depth; // the length of the prefix the state stands for
+	int out;   // the pattern ending here or -1
+	int first; // the first state in the output chain (this one or dict)
+	int dict;  // the next shorter suffix which is a pattern or -1
+} acm_state_t;
+
+struct acm {
+	// patterns, concatenated
+	char *pdata;
+	size_t pdata_len;
+	size_t pdata_cap;
+	int *plens;
+	int npatterns;
+	int patterns_cap;
+
+	// the automaton: a full transition table, a row per state, a column
+	// per byte class. The scan touches nothing else, an entry is the offset
+	// of the target row times 2, the lowest bit is set if the target state
+	// has matches.
+	unsigned char classes[256];
+	int nclasses;
+	int *trans;
+	acm_state_t *states;
+	int nstates;
+	int maxlen; // the length of the longest pattern
+};
+
+static int acm_next(const acm_t *a, int v, char c)
+{
+	return a->trans[(v >> 1) + a->classes[(unsigned char)c]];
+}
+
+// the state of a transition table entry
+static const acm_state_t *acm_state(const acm_t *a, int v)
+{
+	return &a->states[(v >> 1) / a->nclasses];
+}
+
+//------------------------------------------------------------------------------
+
+acm_t *acm_new(void)
+{
+	acm_t *a = (*allocator.alloc)(allocator.ctx, sizeof(acm_t));
+	memset(a, 0, sizeof(acm_t));
+	return a;
+}
+
+void acm_free(acm_t *a)
+{
+	assert(a != 0);
+
+	if (a->pdata)
+		allocator_free(a->pdata, a->pdata_cap);
+	if (a->plens)
+		allocator_free(a->plens, sizeof(int) * a->patterns_cap);
+	if (a->trans) {
+		allocator_free(a->trans,
+			       sizeof(int) * a->nclasses * a->nstates);
+		allocator_free(a->states, sizeof(acm_state_t) * a->nstates);
+	}
+	allocator_free(a, sizeof(acm_t));
+}
+
+int acm_add(acm_t *a, const char *pattern, int len)
+{
+	assert(a != 0);
+	assert(pattern != 0);
+	assert(len > 0);
+	assert(!a->trans);
+
+	if (a->npatterns == a->patterns_cap) {
+		int cap = a->patterns_cap ? a->patterns_cap * 2 : 16;
+		a->plens = allocator_resize(a->plens,
+			sizeof(int) * a->patterns_cap, sizeof(int) * cap);
+		a->patterns_cap = cap;
+	}
+	if (a->pdata_cap - a->pdata_len < (size_t)len) {
+		size_t cap = a->pdata_cap * 2 + len;
+		a->pdata = allocator_resize(a->pdata, a->pdata_cap, cap);
+		a->pdata_cap = cap;
+	}
+	memcpy(a->pdata + a->pdata_len, pattern, len);
+	a->pdata_len += len;
+	a->plens[a->npatterns] = len;
+	if (a->maxlen < len)
+		a->maxlen = len;
+	return a->npatterns++;
+}
+
+void acm_compile(acm_t *a)
+{
+	assert(a != 0);
+	assert(!a->trans);
+
+	// bytes which aren't in any pattern behave the same, they share
+	// class 0, the table has a column per byte class, not per byte
+	memset(a->classes, 0, sizeof(a->classes));
+	for (size_t i = 0; i < a->pdata_len; i++)
+		a->classes[(unsigned char)a->pdata[i]] = 1;
+	a->nclasses = 1;
+	for (int c = 0; c < 256; c++) {
+		if (a->classes[c])
+			a->classes[c] = a->nclasses++;
+	}
+
+	// the trie
+	int nc = a->nclasses;
+	size_t max_states = a->pdata_len + 1;
+	if (max_states > (size_t)(INT_MAX / 2 / nc))
+		out_of_memory();
+	a->trans = (*allocator.alloc)(allocator.ctx,
+				      sizeof(int) * nc * max_states);
+	a->states = (*allocator.alloc)(allocator.ctx,
+				       sizeof(acm_state_t) * max_states);
+	memset(a->trans, 0xFF, sizeof(int) * nc);
+	a->states[0].depth = 0;
+	a->states[0].out = -1;
+	a->nstates = 1;
+
+	const char *p = a->pdata;
+	for (int id = 0; id < a->npatterns; id++) {
+		int s = 0;
+		for (int i = 0; i < a->plens[id]; i++) {
+			int *t = &a->trans[s * nc + a->classes[(unsigned char)p[i]]];
+			if (*t < 0) {
+				*t = a->nstates++;
+				memset(&a->trans[*t * nc], 0xFF, sizeof(int) * nc);
+				a->states[*t].depth = a->states[s].depth + 1;
+				a->states[*t].out = -1;
+			}
+			s = *t;
+		}
+		// the first one of duplicate patterns wins
+		if (a->states[s].out < 0)
+			a->states[s].out = id;
+		p += a->plens[id];
+	}
+
+	// shared prefixes leave rows unused
+	a->trans = allocator_resize(a->trans, sizeof(int) * nc * max_states,
+				    sizeof(int) * nc * a->nstates);
+	a->states = allocator_resize(a->states,
+				     sizeof(acm_state_t) * max_states,
+				     sizeof(acm_state_t) * a->nstates);
+
+	// failure links in BFS order, missing transitions are taken from the
+	// failure state, which turns the trie into a DFA
+	int *fail = (*allocator.alloc)(allocator.ctx, sizeof(int) * a->nstates);
+	int *queue = (*allocator.alloc)(allocator.ctx,
+					sizeof(int) * a->nstates);
+	int head = 0, tail = 0;
+	fail[0] = 0;
+	a->states[0].dict = -1;
+	a->states[0].first = -1;
+	queue[tail++] = 0;
+	while (head < tail) {
+		int u = queue[head++];
+		for (int c = 0; c < nc; c++) {
+			int *t = &a->trans[u * nc + c];
+			if (*t < 0) {
+				*t = u ? a->trans[fail[u] * nc + c] : 0;
+				continue;
+			}
+			int v = *t;
+			int f = u ? a->trans[fail[u] * nc + c] : 0;
+			acm_state_t *vs = &a->states[v];
+			fail[v] = f;
+			vs->dict = a->states[f].out >= 0 ? f : a->states[f].dict;
+			vs->first = vs->out >= 0 ? v : vs->dict;
+			queue[tail++] = v;
+		}
+	}
+	allocator_free(queue, sizeof(int) * a->nstates);
+	allocator_free(fail, sizeof(int) * a->nstates);
+
+	for (int i = 0; i < a->nstates * nc; i++) {
+		int v = a->trans[i];
+		a->trans[i] = (v * nc) << 1 | (a->states[v].first >= 0);
+	}
+}
+
+int acm_patterns(const acm_t *a)
+{
+	assert(a != 0);
+	return a->npatterns;
+}
+
+size_t acm_find_all(const acm_t *a, const char *data, size_t len,
+		    acm_cb_t cb, void *ud)
+{
+	assert(a != 0);
+	assert(a->trans != 0);
+	assert(data != 0 || len == 0);
+
+	size_t n = 0;
+	int v = 0;
+	for (size_t i = 0; i < len; i++) {
+		v = acm_next(a, v, data[i]);
+		if (!(v & 1))
+			continue;
+		int t = acm_state(a, v)->first;
+		for (; t >= 0; t = a->states[t].dict) {
+			n++;
+			const acm_state_t *ts = &a->states[t];
+			if (cb && (*cb)(ud, ts->out, i + 1 - ts->depth, i + 1))
+				return n;
+		}
+	}
+	return n;
+}
+
+// Leftmost-longest non-overlapping replacement, returns the output length,
+// writes the output only if 'out' isn't zero.
+//
+// The longest match starting at each position is kept in a ring indexed by
+// the start. A start is final when no later match can start there: the
+// earliest start of a future match is the current position minus the depth
+// of the current state. Final starts are taken left to right, a match is
+// replaced if it starts after the previous replaced one. The ring only needs
+// to cover the longest pattern, every byte is scanned once and the work is
+// the same as for acm_find_all. Rings for patterns shorter than
+// ACM_RING_STACK live on the stack.
+#define ACM_RING_STACK 256
+
+static size_t acm_replace(const acm_t *a, const char *data, size_t len,
+			  const strview_t *repl, char *out)
+{
+	size_t mask = 1;
+	while (mask <= (size_t)a->maxlen)
+		mask <<= 1;
+	int stack[ACM_RING_STACK * 2];
+	size_t ring_size = sizeof(int) * mask * 2;
+	int *lens = mask <= ACM_RING_STACK ? stack
+			: (*allocator.alloc)(allocator.ctx, ring_size);
+	int *ids = lens + mask;
+	memset(lens, 0, sizeof(int) * mask);
+	mask--;
+
+	size_t olen = 0, copied = 0, i = 0;
+	size_t s = 0; // the first start which isn't final
+	int pending = 0; // the number of non-final starts with matches
+	int v = 0;
+	for (;;) {
+		size_t final = len;
+		if (i < len) {
+			v = acm_next(a, v, data[i++]);
+			if (v & 1) {
+				int t = acm_state(a, v)->first;
+				for (; t >= 0; t = a->states[t].dict) {
+					const acm_state_t *ts = &a->states[t];
+					size_t r = (i - ts->depth) & mask;
+					if (lens[r] < ts->depth) {
+						pending += !lens[r];
+						lens[r] = ts->depth;
+						ids[r] = ts->out;
+					}
+				}
+			}
+			if (!pending) {
+				// no need to look at the state, future matches
+				// can't start before the longest pattern
+				if (i - s > (size_t)a->maxlen)
+					s = i - a->maxlen;
+				continue;
+			}
+			final = i - acm_state(a, v)->depth;
+		}
+
+		for (; s < final; s++) {
+			size_t r = s & mask;
+			if (!lens[r])
+				continue;
+			pending--;
+			if (s >= copied) {
+				const strview_t *rp = &repl[ids[r]];
+				if (out) {
+					memcpy(out + olen, data + copied, s - copied);
+					memcpy(out + olen + s - copied, rp->data, rp->len);
+				}
+				olen += s - copied + rp->len;
+				copied = s + lens[r];
+			}
+			lens[r] = 0;
+		}
+		if (s == len)
+			break;
+	}
+	if (lens != stack)
+		allocator_free(lens, ring_size);
+
+	if (out)
+		memcpy(out + olen, data + copied, len - copied);
+	return olen + len - copied;
+}
+
+str_t *str_replace_all(const str_t *str, const acm_t *a,
+		       const strview_t *replacements)
+{
+	assert(str != 0);
+	assert(a != 0);
+	assert(a->trans != 0);
+	assert(replacements != 0 || a->npatterns == 0);
+
+	size_t len = acm_replace(a, str->data, str->len, replacements, 0);
+	if (len > INT_MAX)
+		length_overflow();
+
+	str_t *out = str_new(len);
+	acm_replace(a, str->data, str->len, replacements, out->data);
+	out->len = len;
+	out->data[len] = '\0';
+	return out;
+}
@@ -18,6 +18,8 @@
 //  - Unsigned is a bit faster if you divide an integer (in some cases). It is
 // just a premature optimization.
 //
+// For the rare cases where 2 billion is not enough, there is lstr_t.
+//
 // The amount of memory required for a str with capacity == 5 is:
 //	(sizeof(str_t) + 5 + 1)
 //
@@ -25,24 +27,151 @@
 // capacity.
 //
 // String data is always a correct C string.
+//
+// IMPORTANT: 'cap' is not always the capacity. Special strings, the ones made
+// by str_new_reserved and str_freeze, have 'cap' == -1 and keep their real
+// capacity in a hidden header in front of the str_t. They work with all the
+// functions below, but code that reads 'cap' directly has to use str_cap
+// instead, and code that fills a str_t by hand must never set 'cap' < 0.
 
 #include <stddef.h> // for size_t
+#include <stdint.h> // for int64_t, uint64_t
 
+// 'realloc' is optional (can be zero), it has the same semantics as the
+// standard realloc and it is used by str_ensure_cap to grow strings, which
+// gives an allocator a chance to extend the block in place instead of doing
+// malloc + copy + free.
+//
+// 'good_size' is optional (can be zero), it returns the real size of a block
+// the allocator will hand out for a request of 'size' bytes. Strings use it to
+// turn the allocator's slack into usable capacity.
 typedef struct str_allocator {
 	void *(*malloc)(size_t);
 	void (*free)(void*);
+	void *(*realloc)(void*, size_t);
+	size_t (*good_size)(size_t);
 } str_allocator_t;
 
+// str_allocator2_t is a stateful allocator interface. Every call receives the
+// 'ctx' pointer and 'free' receives the size of the block, which is always the
+// same size that was passed to 'alloc' (or 'resize'). Sizes are rounded with
+// 'good_size' beforehand if it's present.
+//
+// 'resize' and 'good_size' are optional (can be zero). 'resize' has the
+// semantics of the standard realloc: it may move the block, contents are
+// preserved.
+typedef struct str_allocator2 {
+	void *ctx;
+	void *(*alloc)(void *ctx, size_t size);
+	void (*free)(void *ctx, void *ptr, size_t size);
+	void *(*resize)(void *ctx, void *ptr, size_t old_size, size_t new_size);
+	size_t (*good_size)(void *ctx, size_t size);
+} str_allocator2_t;
+
 // These functions do not store the pointer to an allocator structure, they
 // just copy the contents of this structure.
 //
-// str_set_allocator - to specify a new pair of allocator functions for a
-// current thread
+// str_set_allocator - to specify a new set of allocator functions for a
+// current thread. Internally it is wrapped into a str_allocator2_t adapter.
+//
+// str_get_allocator - to retrieve a set of allocator functions for a current
+// thread. If the current allocator was installed with str_set_allocator2
+// (including the arena and the pool allocators), the result is an adapter:
+// passing it to str_set_allocator installs the original str_allocator2_t
+// again. There is one such adapter per thread, it refers to the allocator
+// seen by the last str_get_allocator call, so nested saves of different
+// str_allocator2_t need str_get_allocator2. Its functions can be called
+// directly too, blocks carry a small header with their size then.
 //
-// str_get_allocator - to retrieve a pair of allocator functions for a current
-// thread.
+// str_set_allocator2/str_get_allocator2 - the same for the stateful interface.
 void str_set_allocator(const str_allocator_t *new_alloc);
 void str_get_allocator(str_allocator_t *out);
+void str_set_allocator2(const str_allocator2_t *new_alloc);
+void str_get_allocator2(str_allocator2_t *out);
+
+// str_arena_t is a bump-pointer arena for short-lived strings. When it is
+// installed as an allocator, str_free is a no-op and the memory of all strings
+// is reclaimed at once with str_arena_reset or str_arena_release. Blocks are
+// kept for reuse, so after a warm-up there are no malloc/free calls at all.
+//
+// Nested scopes are supported through marks:
+//	str_arena_mark_t m = str_arena_mark(&arena);
+//	... allocate strings ...
+//	str_arena_release(&arena, m); // all strings since 'm' are gone
+typedef struct str_arena_block str_arena_block_t;
+
+typedef struct str_arena {
+	str_arena_block_t *head;  // current block, linked to the previous ones
+	str_arena_block_t *spare; // released blocks, waiting for reuse
+	size_t block_size;
+} str_arena_t;
+
+typedef struct str_arena_mark {
+	str_arena_block_t *block;
+	size_t used;
+} str_arena_mark_t;
+
+// if 'block_size' is 0, STR_ARENA_BLOCK_SIZE is used
+#ifndef STR_ARENA_BLOCK_SIZE
+#define STR_ARENA_BLOCK_SIZE 65536
+#endif
+
+void str_arena_init(str_arena_t *arena, size_t block_size);
+void str_arena_free(str_arena_t *arena); // returns all blocks to the system
+void str_arena_reset(str_arena_t *arena);
+
+str_arena_mark_t str_arena_mark(str_arena_t *arena);
+void str_arena_release(str_arena_t *arena, str_arena_mark_t mark);
+
+// Fills 'out' with an allocator which allocates from 'arena'. Growing the
+// most recently allocated string extends it in place.
+void str_arena_get_allocator(str_arena_t *arena, str_allocator2_t *out);
+
+// Size-class pool allocator for small strings. Requests up to
+// STR_POOL_MAX_SIZE bytes are served from per-thread free lists, one per size
+// class (16 bytes apart up to 128, 32 bytes apart up to 256), carved out of
+// big slabs. Larger requests go to malloc. Slabs are never returned to the
+// system.
+//
+// Strings can be passed between threads: every slab remembers the thread
+// cache it belongs to and a block freed by another thread goes back to its
+// owner through a lock-free queue. Pool blocks are recognized by address, so
+// this works whatever allocator the freeing thread has installed. Strings
+// bigger than STR_POOL_MAX_SIZE are malloc blocks, as are blocks of the default
+// allocator freed while the pool is installed.
+#define STR_POOL_MAX_SIZE 256
+
+void str_pool_get_allocator(str_allocator2_t *out);
+
+// Per-thread allocation statistics. They are collected only if strstr.c is
+// compiled with STR_STATS defined, otherwise the counters compile to nothing
+// and str_get_stats returns zeros.
+//
+// allocs, frees           - number of str allocations and frees
+// bytes_requested         - bytes requested from the allocator, growing a block
+//                           with 'resize' counts only the growth
+// bytes_slack             - unused capacity of strings at the moment of free
+// regrows                 - number of times str_ensure_cap had to grow a str
+// regrow_bytes_copied     - bytes copied by these regrowths
+// printf_double_passes    - str_printf/str_add_printf calls, each one runs
+//                           vsnprintf twice: to measure and to write
+typedef struct str_stats {
+	unsigned long long allocs;
+	unsigned long long frees;
+	unsigned long long bytes_requested;
+	unsigned long long bytes_slack;
+	unsigned long long regrows;
+	unsigned long long regrow_bytes_copied;
+	unsigned long long printf_double_passes;
+} str_stats_t;
+
+void str_get_stats(str_stats_t *out);
+void str_reset_stats(void);
+
+// initial read size for files of unknown size, it grows geometrically
+#ifndef STR_READ_CHUNK
+#define STR_READ_CHUNK 4096
+#endif
 
 // should be > 0, and remember, that real memory size is +1 (trailing \0 byte)
 #ifndef STR_DEFAULT_CAPACITY
@@ -50,7 +179,7 @@ void str_get_allocator(str_allocator_t *out);
 #endif
 
 typedef struct str {
-	int cap;
+	int cap; // < 0 for special strings, see str_cap
 	int len;
 	char data[];
 } str_t;
@@ -63,12 +192,38 @@ str_t *str_printf(const char *fmt, ...);
 str_t *str_dup(const str_t *str);
 str_t *str_from_file(const char *filename); // *nix only
 
+// Reads everything from 'fd' until EOF with plain read calls (*nix only).
+// Works with pipes, sockets and procfs files, where the file size is
+// meaningless. Regular files with a known size are read with a single read.
+// Returns zero on a read error.
+str_t *str_from_fd(int fd);
+
+// Creates a special string backed by 'reserve' bytes of reserved virtual
+// address space (*nix only). Pages are committed on demand, growth within the
+// reservation doesn't copy anything and doesn't move the string. Going beyond
+// the reservation moves the string to a bigger one, only the pages in use stay
+// committed. On linux the pages are remapped with mremap and nothing is
+// copied, elsewhere the string is copied. Returns zero if the address space
+// can't be reserved.
+str_t *str_new_reserved(size_t reserve);
+
+// Freezes 'str', makes it immutable and shared (consumes 'str', returns a new
+// pointer). str_dup of a frozen string just increments an atomic reference
+// count and returns the same pointer, str_free decrements it. Any str_add_*
+// on a frozen string first detaches a private mutable copy. In-place
+// modifications (str_clear, trimming) are not allowed on frozen strings.
+str_t *str_freeze(str_t *str);
+int str_is_frozen(const str_t *str);
+
 void str_free(str_t *str);
 void str_clear(str_t *str);
 
 // make sure there is enough capacity for 'n' additional bytes
 void str_ensure_cap(str_t **str, int n);
 
+// the real capacity of 'str', works for special strings too
+int str_cap(const str_t *str);
+
 // appending to str_t
 void str_add_str(str_t **str, const str_t *str2);
 void str_add_cstr(str_t **str, const char *cstr);
@@ -76,17 +231,220 @@ void str_add_cstr_len(str_t **str, const char *cstr, int len);
 void str_add_printf(str_t **str, const char *fmt, ...);
 void str_add_file(str_t **str, const char *filename); // *nix only
 
+// Appending numbers without going through vsnprintf. Integers are written in
+// decimal, str_add_hex writes lowercase digits without a prefix. Doubles are
+// formatted with Grisu2: the output always reads back (strtod) as the same
+// value, but it is not guaranteed to be the shortest such digit string, for a
+// few doubles in a thousand it is one digit longer. They are written in fixed
+// notation for magnitudes in [1e-6, 1e21) and as "d.ddde+x" otherwise,
+// specials are "nan", "inf", "-inf".
+void str_add_i64(str_t **str, int64_t v);
+void str_add_u64(str_t **str, uint64_t v);
+void str_add_hex(str_t **str, uint64_t v);
+void str_add_double(str_t **str, double v);
+
+// Returns the number of bytes appended or -1 on a read error, in which case
+// 'str' is left as it was (*nix only).
+int str_add_fd(str_t **str, int fd);
+
+// Writing (*nix only). Arrays of strings are written with writev, in batches
+// of IOV_MAX, without concatenating them first (see also fstr_writev_fd).
+// Zero pointers in the arrays are skipped. Partial writes are resumed.
+// Return 0 on success, -1 on error with errno set, in which case an unknown
+// part of the data was written.
+int str_write_fd(int fd, const str_t *str);
+int str_writev_fd(int fd, const str_t *const *strs, int n);
+
+// Atomically replaces 'filename' with the concatenation of 'strs': writes a
+// temporary file in the same directory, fsyncs it, renames it over 'filename'
+// and fsyncs the directory. Readers see either the old or the new contents,
+// and once it returns 0 the new contents survive a crash. If only the
+// directory fsync fails, -1 is returned but the file is already replaced. The
+// new file gets the default permissions (0666 & ~umask).
+int str_writev_file(const char *filename, const str_t *const *strs, int n);
+
 // trim, removes 'isspace' characters from sides: both, left, right
 void str_trim(str_t *str);
 void str_ltrim(str_t *str);
 void str_rtrim(str_t *str);
 
+// The same for ASCII whitespace only (" \t\n\v\f\r"), independent of the
+// locale and a lot faster, the string is scanned 16 or 32 bytes at a time with
+// SSE2 or AVX2 if they are enabled at compile time.
+void str_trim_ascii(str_t *str);
+void str_ltrim_ascii(str_t *str);
+void str_rtrim_ascii(str_t *str);
+
+// Finds what str_trim_ascii would leave, [start, end), without modifying
+// the string.
+void str_trim_offsets(const str_t *str, int *start, int *end);
+
+// Searching, bounded by 'len', zero bytes are not special. Return the offset
+// of the first (str_rfind: the last) occurrence of 'needle' or -1, an empty
+// needle is found at the beginning (the end). str_count returns the number of
+// non-overlapping occurrences, 0 for an empty needle. The _mem versions work
+// with any memory range, see also fstr_find and strview_find.
+//
+// Candidate positions are found with SSE2/AVX2 (if enabled at compile time),
+// comparing the first and the last byte of the needle at 16/32 positions at
+// once. Degenerate inputs, which produce too many candidates, fall back to the
+// Two-Way algorithm, the worst case is linear.
+int str_find(const str_t *str, const char *needle, int len);
+int str_rfind(const str_t *str, const char *needle, int len);
+int str_find_char(const str_t *str, char c);
+int str_count(const str_t *str, const char *needle, int len);
+
+ptrdiff_t str_find_mem(const char *hay, size_t hlen, const char *needle,
+		       size_t nlen);
+ptrdiff_t str_rfind_mem(const char *hay, size_t hlen, const char *needle,
+			size_t nlen);
+ptrdiff_t str_find_char_mem(const char *hay, size_t hlen, char c);
+size_t str_count_mem(const char *hay, size_t hlen, const char *needle,
+		     size_t nlen);
+
 // Splits 'path' immediately following the final path separator, separating it
 // into a directory and file name component. Returns a directory component if
 // any (if none, returns zero). If 'half2' isn't zero, writes file name
 // component to it (allocating a str, you're responsible to free it).
 str_t *str_split_path(const str_t *path, str_t **half2); // *nix only
 
+// Loads 'n' files in parallel (*nix only). Paths are opened with openat
+// relative to 'dirfd' (AT_FDCWD for the current directory). The work is
+// spread across 'threads' threads, the calling one included, if 'threads' is
+// <= 0 the number of CPUs is used. Either way no more than STR_LOAD_MAX_THREADS
+// threads are used.
+//
+// out[i] receives the contents of paths[i] or zero on failure, in which case
+// errors[i] (if 'errors' isn't zero) receives the errno value, it's zero on
+// success. Strings are allocated with the calling thread's allocator.
+// Returns the number of files that failed to load.
+#ifndef STR_LOAD_MAX_THREADS
+#define STR_LOAD_MAX_THREADS 8
+#endif
+
+int str_from_files(int dirfd, const char **paths, int n, str_t **out,
+		   int *errors, int threads);
+
+// str_loader_t loads files asynchronously (*nix only). On linux 5.6+ it uses
+// io_uring: files are opened in str_loader_submit, reads are queued and passed
+// to the kernel in batches, up to 'depth' at a time. Otherwise, or with
+// STR_LOADER_NO_URING, a pool of STR_LOADER_THREADS threads does
+// str_from_file. The threads allocate through the allocator which was current
+// in str_loader_new if it's thread-safe (the default or the pool one).
+// Otherwise they use the default allocator and str_loader_poll copies the
+// contents into a str of the calling thread's allocator.
+//
+// str_loader_poll calls the callbacks of the finished loads on the calling
+// thread and returns their number. If 'wait' is non-zero and there are pending
+// loads, it blocks until at least one finishes. The callback receives the
+// contents, you're responsible to free the str, or zero and the errno value.
+// Callbacks may submit more files.
+//
+// str_loader_submit returns -1 and sets errno if the file can't be opened
+// (io_uring only, the thread pool reports it via the callback), 0 otherwise.
+// str_loader_free waits for the loads in progress and discards them.
+#ifndef STR_LOADER_THREADS
+#define STR_LOADER_THREADS 4
+#endif
+#define STR_LOADER_DEPTH 64
+
+enum {
+	STR_LOADER_NO_URING = 1,
+};
+
+typedef struct str_loader str_loader_t;
+typedef void (*str_loader_cb_t)(void *data, str_t *str, int error);
+
+str_loader_t *str_loader_new(int depth, int flags);
+void str_loader_free(str_loader_t *l);
+int str_loader_submit(str_loader_t *l, const char *filename,
+		      str_loader_cb_t cb, void *data);
+int str_loader_poll(str_loader_t *l, int wait);
+int str_loader_pending(str_loader_t *l);
+
+// mstr_t is a read-only view of a memory-mapped file (*nix only). Loading is
+// O(1), pages are read on demand and shared with the page cache. Like str_t,
+// 'data' is always zero-terminated, the mapping is extended with a zero page
+// when the file size is a multiple of the page size.
+//
+// The file must not be truncated while it's mapped, accessing pages beyond
+// the new end of the file results in SIGBUS.
+typedef struct mstr {
+	size_t len;
+	const char *data;
+	size_t map_len;
+} mstr_t;
+
+// access pattern hints, passed to madvise
+enum {
+	MSTR_NORMAL,
+	MSTR_SEQUENTIAL,
+	MSTR_RANDOM,
+	MSTR_WILLNEED
+};
+
+// returns zero if the file can't be opened or mapped
+mstr_t *mstr_from_file(const char *filename, int hint);
+void mstr_free(mstr_t *mstr);
+
+// lreader_t reads a file line by line with bounded memory (*nix only). Two
+// chunk buffers are used: a background thread reads the next chunk while the
+// caller parses the current one. Lines handed out by lreader_next point into
+// the reader's buffers, they are zero-terminated (the newline is replaced)
+// and valid until the next call. Memory usage is two chunks plus the longest
+// line that crosses a chunk boundary.
+typedef struct lreader lreader_t;
+
+// if 'chunk_size' is <= 0, LREADER_CHUNK_SIZE is used
+#ifndef LREADER_CHUNK_SIZE
+#define LREADER_CHUNK_SIZE (1 << 20)
+#endif
+
+// returns zero if the file can't be opened
+lreader_t *lreader_open(const char *filename, int chunk_size);
+void lreader_close(lreader_t *reader);
+
+// Returns 1 and a line without the trailing newline, 0 at the end of the
+// file or -1 on a read error.
+int lreader_next(lreader_t *reader, const char **line, int *len);
+
+// tstr_t is a compact immutable string for tables of millions of tiny
+// strings:
+// +--------+-------------+
+// | LEN    | STRING DATA |
+// +--------+-------------+
+//
+// The length is a varint (7 bits per byte): 1 byte for strings shorter than
+// 128 bytes, 2 bytes up to 16K. There is no capacity, the allocation is an
+// exact fit: varint + length + 1 (zero termination). Memory comes from the
+// current str allocator, the pool or the arena allocator is a good match.
+typedef struct tstr tstr_t;
+
+tstr_t *tstr_from_cstr(const char *cstr);
+tstr_t *tstr_from_cstr_len(const char *cstr, int len);
+tstr_t *tstr_from_str(const str_t *str);
+str_t *str_from_tstr(const tstr_t *tstr);
+void tstr_free(tstr_t *tstr);
+
+static inline int tstr_len(const tstr_t *tstr)
+{
+	const unsigned char *p = (const unsigned char*)tstr;
+	int len = 0, shift = 0;
+	do {
+		len |= (*p & 0x7F) << shift;
+		shift += 7;
+	} while (*p++ & 0x80);
+	return len;
+}
+
+static inline const char *tstr_data(const tstr_t *tstr)
+{
+	const unsigned char *p = (const unsigned char*)tstr;
+	while (*p++ & 0x80)
+		;
+	return (const char*)p;
+}
+
 // fstr_t is a fixed string.
 // It doesn't manage its own memory, that's why it's called fixed.
 //
@@ -106,3 +464,279 @@ void fstr_init(fstr_t *fstr, char *data, int len, int cap);
 void fstr_add_str(fstr_t *fstr, const str_t *str);
 void fstr_add_cstr(fstr_t *fstr, const char *cstr);
 void fstr_add_printf(fstr_t *fstr, const char *fmt, ...);
+
+// see str_add_i64
+void fstr_add_i64(fstr_t *fstr, int64_t v);
+void fstr_add_u64(fstr_t *fstr, uint64_t v);
+void fstr_add_hex(fstr_t *fstr, uint64_t v);
+void fstr_add_double(fstr_t *fstr, double v);
+
+// see str_writev_fd
+int fstr_writev_fd(int fd, const fstr_t *const *strs, int n);
+
+// see str_find
+int fstr_find(const fstr_t *fstr, const char *needle, int len);
+int fstr_rfind(const fstr_t *fstr, const char *needle, int len);
+int fstr_find_char(const fstr_t *fstr, char c);
+int fstr_count(const fstr_t *fstr, const char *needle, int len);
+
+// istr_t is a growable string which starts in a caller-provided (usually
+// stack) buffer and spills to an allocator-backed str_t only when the buffer
+// overflows. Unlike fstr_t it never truncates.
+//
+// 'data' points either to the buffer or to the str_t's data, 'cap' and 'len'
+// have the same meaning as in fstr_t. Once spilled, the string stays on the
+// heap until istr_free or istr_to_str.
+typedef struct istr {
+	int cap;
+	int len;
+	char *data;
+	str_t *heap;
+	char *buf;
+	int buf_cap;
+} istr_t;
+
+#define ISTR_INIT_FOR_BUF(istr, buf)\
+	istr_init(istr, buf, sizeof(buf)/sizeof(buf[0])-1)
+void istr_init(istr_t *istr, char *buf, int cap);
+
+// frees the heap part (if any), the istr_t is empty and inline afterwards
+void istr_free(istr_t *istr);
+void istr_clear(istr_t *istr);
+
+// Returns the contents as an allocated str_t (without a copy if the string
+// has spilled already). The istr_t is empty and inline afterwards.
+str_t *istr_to_str(istr_t *istr);
+
+// make sure there is enough capacity for 'n' additional bytes
+void istr_ensure_cap(istr_t *istr, int n);
+
+// appending to an istr_t
+void istr_add_str(istr_t *istr, const str_t *str);
+void istr_add_cstr(istr_t *istr, const char *cstr);
+void istr_add_cstr_len(istr_t *istr, const char *cstr, int len);
+void istr_add_printf(istr_t *istr, const char *fmt, ...);
+
+// rstr_t is a segmented string builder (a rope) for big outputs. The contents
+// are stored in a chain of fixed-size chunks allocated from the current
+// allocator, growing never copies nor moves anything. 'chunk_size' is the
+// capacity of a chunk, 0 means RSTR_CHUNK_SIZE.
+//
+// A rstr_t can be flattened into a single str_t (rstr_to_str returns zero
+// and sets errno to EFBIG if the contents don't fit) or written to a file
+// descriptor chunk by chunk with writev, see str_writev_fd.
+#define RSTR_CHUNK_SIZE 65536
+
+typedef struct rstr_chunk rstr_chunk_t;
+
+typedef struct rstr {
+	rstr_chunk_t *head;
+	rstr_chunk_t *tail;
+	size_t len;
+	int chunk_size;
+} rstr_t;
+
+void rstr_init(rstr_t *rstr, int chunk_size);
+void rstr_free(rstr_t *rstr);
+void rstr_clear(rstr_t *rstr); // keeps the first chunk
+
+str_t *rstr_to_str(const rstr_t *rstr);
+int rstr_write_fd(const rstr_t *rstr, int fd);
+
+// appending to a rstr_t
+void rstr_add_str(rstr_t *rstr, const str_t *str);
+void rstr_add_cstr(rstr_t *rstr, const char *cstr);
+void rstr_add_cstr_len(rstr_t *rstr, const char *cstr, int len);
+void rstr_add_printf(rstr_t *rstr, const char *fmt, ...);
+
+// spack_t is a read-only archive of many small files (*nix only), packed
+// into a single file with a sorted path index. Opening an archive is one open
+// and one mmap (see mstr_t), lookups are binary searches returning pointers
+// into the mapping, nothing is copied. Payloads are 8-byte aligned and
+// zero-terminated. Archives use the native byte order.
+//
+// spack_write packs 'n' strings under the given paths (duplicate paths are an
+// error, EINVAL), spack_write_dir packs all regular files under 'dir'
+// (relative to 'dirfd', AT_FDCWD for the current directory) with paths
+// relative to 'dir', like "sub/file.txt", files are read in parallel with
+// str_from_files. Both replace the archive atomically, see str_writev_file,
+// and return 0 on success, -1 on error with errno set.
+//
+// spack_open returns zero on error, the errno is EINVAL if the file is not
+// a valid archive. spack_find returns the contents of the file at 'path' and
+// writes its length to 'len' (if 'len' isn't zero) or returns zero if there
+// is no such file. spack_get returns the i-th file in the path order.
+typedef struct spack spack_t;
+
+int spack_write(const char *filename, const char *const *paths,
+		const str_t *const *strs, int n);
+int spack_write_dir(const char *filename, int dirfd, const char *dir);
+
+spack_t *spack_open(const char *filename);
+void spack_close(spack_t *p);
+int spack_count(const spack_t *p);
+const char *spack_find(const spack_t *p, const char *path, int *len);
+const char *spack_get(const spack_t *p, int i, const char **path, int *len);
+
+// lstr_t is str_t with 64-bit length and capacity for data over 2GB, it
+// uses the same allocator and the same growth policy. Growth is overflow
+// checked, like with str_t a length which doesn't fit is a fatal error.
+// Reading a file which doesn't fit into a str_t fails with EFBIG, this is
+// what you use instead.
+typedef struct lstr {
+	size_t cap;
+	size_t len;
+	char data[];
+} lstr_t;
+
+lstr_t *lstr_new(size_t cap);
+lstr_t *lstr_from_file(const char *filename); // *nix only
+lstr_t *lstr_from_fd(int fd);                 // *nix only
+void lstr_free(lstr_t *str);
+void lstr_clear(lstr_t *str);
+
+// make sure there is enough capacity for 'n' additional bytes
+void lstr_ensure_cap(lstr_t **str, size_t n);
+
+// appending to lstr_t
+void lstr_add_str(lstr_t **str, const str_t *str2);
+void lstr_add_lstr(lstr_t **str, const lstr_t *str2);
+void lstr_add_cstr(lstr_t **str, const char *cstr);
+void lstr_add_cstr_len(lstr_t **str, const char *cstr, size_t len);
+void lstr_add_printf(lstr_t **str, const char *fmt, ...);
+
+// same as str_add_fd and str_write_fd (*nix only)
+ptrdiff_t lstr_add_fd(lstr_t **str, int fd);
+int lstr_write_fd(int fd, const lstr_t *str);
+
+// lindex_t is an index of line offsets in a text, for random access to lines
+// of big files, usually a str_t or a mstr_t. Newlines are found with SSE2
+// when available, only the start of every LINDEX_SAMPLE-th line is stored,
+// a lookup rescans at most LINDEX_SAMPLE - 1 lines from there.
+//
+// lindex_update indexes data[scanned, len), the data must be the same as in
+// the previous calls plus the appended part (it may move, like a growing
+// str_t). The text is split at '\n', which isn't a part of a line, the last
+// line counts if it's not empty. lindex_line finds line 'n' (zero-based),
+// returns 0 if there is no such line, 1 otherwise.
+#define LINDEX_SAMPLE 64
+
+typedef struct lindex {
+	size_t *samples; // samples[k] is the offset of line k*LINDEX_SAMPLE
+	size_t nsamples;
+	size_t samples_cap;
+	size_t newlines;
+	size_t last;    // offset of the last line
+	size_t scanned; // bytes indexed so far
+} lindex_t;
+
+void lindex_init(lindex_t *idx);
+void lindex_free(lindex_t *idx);
+void lindex_update(lindex_t *idx, const char *data, size_t len);
+size_t lindex_lines(const lindex_t *idx);
+int lindex_line(const lindex_t *idx, const char *data, size_t n,
+		const char **line, size_t *len);
+
+// strview_t is a non-owning view of a string: a pointer and a length. It's
+// not zero-terminated and it's valid as long as the viewed buffer is (for a
+// str_t, until the next append). None of the strview_* functions allocate.
+typedef struct strview {
+	const char *data;
+	size_t len;
+} strview_t;
+
+static inline strview_t strview(const char *data, size_t len)
+{
+	strview_t v = {data, len};
+	return v;
+}
+
+static inline strview_t strview_from_cstr(const char *cstr)
+{
+	size_t len = 0;
+	while (cstr[len])
+		len++;
+	return strview(cstr, len);
+}
+
+static inline strview_t strview_from_str(const str_t *str)
+{
+	return strview(str->data, str->len);
+}
+
+static inline strview_t strview_from_fstr(const fstr_t *fstr)
+{
+	return strview(fstr->data, fstr->len);
+}
+
+// copying a view into a str
+str_t *str_from_strview(strview_t v);
+void str_add_strview(str_t **str, strview_t v);
+
+int strview_eq(strview_t a, strview_t b);
+int strview_cmp(strview_t a, strview_t b); // like memcmp, shorter is less
+
+// trim, removes 'isspace' characters from sides: both, left, right
+strview_t strview_trim(strview_t v);
+strview_t strview_ltrim(strview_t v);
+strview_t strview_rtrim(strview_t v);
+strview_t strview_trim_ascii(strview_t v); // see str_trim_ascii
+
+// Return the offset of the first (strview_rfind: the last) occurrence or -1.
+ptrdiff_t strview_find(strview_t v, strview_t needle);
+ptrdiff_t strview_rfind(strview_t v, strview_t needle);
+ptrdiff_t strview_find_char(strview_t v, char c);
+
+// Splits 'v' at the first 'sep' into 'head' and 'tail' (either can be zero),
+// 'sep' belongs to neither. Returns 0 if there is no 'sep', 'head' is the
+// whole 'v' and 'tail' is empty then.
+int strview_split(strview_t v, char sep, strview_t *head, strview_t *tail);
+
+// Tokenizing: skips characters from 'delims' at the beginning of 'rest',
+// writes the following run of other characters to 'token' and advances 'rest'
+// past it. Returns 0 if there are no more tokens.
+//
+//	strview_t rest = strview_from_str(str), tok;
+//	while (strview_next_token(&rest, " \t\n", &tok))
+//		...
+int strview_next_token(strview_t *rest, const char *delims, strview_t *token);
+
+// Same as str_split_path: returns 1 and the directory part in 'dir' (if 'dir'
+// isn't zero) if there is one, otherwise 0. 'file' receives the file name
+// part, which is the whole path if there is no directory part.
+int strview_split_path(strview_t path, strview_t *dir, strview_t *file);
+
+// acm_t is an Aho-Corasick automaton, it finds all occurrences of many
+// patterns in a single pass over a text. Patterns are added with acm_add,
+// which returns their ids (0, 1, 2, ...), then the automaton is built with
+// acm_compile, no patterns can be added afterwards. Patterns can't be empty,
+// if a pattern is added twice, matches are reported with the first id.
+//
+// The automaton is a flat transition table with a row per state. Bytes are
+// mapped to classes first, all the bytes which don't occur in the patterns
+// share one class, so the rows are short.
+//
+// acm_find_all calls 'cb' for every match, overlapping ones included, in the
+// order of their end offsets, [start, end) is the match. If 'cb' returns
+// non-zero, the search stops. Returns the number of matches ('cb' can be
+// zero for just counting).
+typedef struct acm acm_t;
+typedef int (*acm_cb_t)(void *data, int id, size_t start, size_t end);
+
+acm_t *acm_new(void);
+void acm_free(acm_t *a);
+int acm_add(acm_t *a, const char *pattern, int len);
+void acm_compile(acm_t *a);
+int acm_patterns(const acm_t *a);
+size_t acm_find_all(const acm_t *a, const char *data, size_t len,
+		    acm_cb_t cb, void *ud);
+
+// Returns a copy of 'str' with matches of the patterns of 'a' replaced by
+// 'replacements[id]'. Matches are chosen leftmost-longest: of the matches
+// starting first, the longest one is replaced, the next match is looked
+// for after it. The text is scanned twice, the first pass computes the size
+// of the result, so the result is allocated once. If the longest pattern is
+// 256 bytes or longer, each pass also allocates and frees a scratch buffer,
+// which makes 3 allocations in total, otherwise the result is the only one.
+str_t *str_replace_all(const str_t *str, const acm_t *a,
+		       const strview_t *replacements);
@@ -1,6 +1,14 @@
+#define _POSIX_C_SOURCE 200809L // for mkstemp
 #include "strstr.h"
 #include <check.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <math.h>
+#include <sys/stat.h>
 
 //-------------------------------------------------------------------------------
 // Simplest possible debug alloc
@@ -23,6 +31,17 @@ static void debug_free(void *p)
 	free(p);
 }
 
+static int reallocations = 0;
+
+static void *debug_realloc(void *p, size_t size)
+{
+	p = realloc(p, size);
+	if (!p)
+		fail("realloc failed");
+	reallocations++;
+	return p;
+}
+
 static void setup_debug_allocator()
 {
 	str_allocator_t alloc = {
@@ -133,6 +152,76 @@ START_TEST(test_str_ensure_cap)
 }
 END_TEST
 
+START_TEST(test_str_ensure_cap_realloc)
+{
+	str_allocator_t alloc = {
+		debug_malloc,
+		debug_free,
+		debug_realloc
+	};
+	str_set_allocator(&alloc);
+
+	str_t *str = str_from_cstr("hello");
+	str_ensure_cap(&str, 50);
+	CHECK_STR(str, >= 55, == 5, "hello");
+	fail_unless(reallocations == 1,
+		    "1 reallocation expected, got: %d", reallocations);
+
+	// enough capacity, no reallocation
+	str_add_cstr(&str, "world");
+	CHECK_STR(str, >= 55, == 10, "helloworld");
+	fail_unless(reallocations == 1,
+		    "1 reallocation expected, got: %d", reallocations);
+	str_free(str);
+}
+END_TEST
+
+START_TEST(test_str_new_reserved)
+{
+	str_t *str = str_new_reserved(1 << 24);
+	fail_unless(str != 0, "reservation failed");
+	fail_unless(str->cap < 0, "special string expected");
+	CHECK_STR(str, < 0, == 0, "");
+
+	// grows in place
+	str_t *orig = str;
+	for (int i = 0; i < 100000; i++)
+		str_add_cstr(&str, "0123456789");
+	fail_unless(str == orig, "the string should not move");
+	fail_unless(str->len == 1000000,
+		    "1000000 length expected, got: %d", str->len);
+	str_add_printf(&str, "%d", 31337);
+	str_add_file(&str, "testdata/file.txt");
+	fail_unless(strcmp(str->data + 1000000, "31337123456789\n") == 0,
+		    "\"31337123456789\\n\" suffix expected, got: \"%s\"",
+		    str->data + 1000000);
+	str_free(str);
+
+	// grows beyond the reservation
+	str = str_new_reserved(1);
+	for (int i = 0; i < 100000; i++)
+		str_add_cstr(&str, "0123456789");
+	fail_unless(str->len == 1000000,
+		    "1000000 length expected, got: %d", str->len);
+	fail_unless(strncmp(str->data + 999990, "0123456789", 10) == 0,
+		    "\"0123456789\" suffix expected");
+	str_free(str);
+
+	// a big jump beyond the reservation commits only what's needed
+	str = str_new_reserved(1 << 20);
+	str_ensure_cap(&str, 3 << 19);
+	int cap = str_cap(str);
+	fail_unless(cap >= 3 << 19 && cap < 1 << 21,
+		    "[1572864, 2097152) capacity expected, got: %d", cap);
+	memset(str->data, 'x', cap);
+	str->len = cap;
+	str_add_cstr(&str, "y");
+	fail_unless(str_cap(str) > cap && str->data[cap] == 'y',
+		    "the string should grow within the new reservation");
+	str_free(str);
+}
+END_TEST
+
 START_TEST(test_str_printf)
 {
 	// here I'm not checking all the printf stuff, because I use snprintf,
@@ -153,6 +242,42 @@ START_TEST(test_str_dup)
 }
 END_TEST
 
+START_TEST(test_str_freeze)
+{
+	str_t *str1 = str_freeze(str_from_cstr("config value"));
+	fail_unless(str_is_frozen(str1), "frozen string expected");
+	fail_unless(strcmp(str1->data, "config value") == 0,
+		    "\"config value\" expected, got: \"%s\"", str1->data);
+
+	// duplicates share the data
+	str_t *str2 = str_dup(str1);
+	str_t *str3 = str_dup(str1);
+	fail_unless(str1 == str2 && str1 == str3, "shared string expected");
+
+	// reserving or appending nothing doesn't copy
+	str_ensure_cap(&str2, 0);
+	str_add_printf(&str2, "%s", "");
+	fail_unless(str2 == str1 && str_is_frozen(str2),
+		    "shared string expected");
+
+	// appending detaches a private copy
+	str_add_cstr(&str2, "!");
+	fail_unless(str2 != str1 && !str_is_frozen(str2),
+		    "private copy expected");
+	CHECK_STR(str2, >= 13, == 13, "config value!");
+	fail_unless(strcmp(str1->data, "config value") == 0,
+		    "\"config value\" expected, got: \"%s\"", str1->data);
+
+	// appending a shared string to itself
+	str_add_str(&str3, str1);
+	CHECK_STR(str3, >= 24, == 24, "config valueconfig value");
+
+	str_free(str1);
+	str_free(str2);
+	str_free(str3);
+}
+END_TEST
+
 START_TEST(test_str_from_file)
 {
 	str_t *str = str_from_file("testdata/file.txt");
@@ -165,6 +290,268 @@ START_TEST(test_str_from_file)
 }
 END_TEST
 
+START_TEST(test_str_from_fd)
+{
+	// procfs files report zero size
+	str_t *str = str_from_file("/proc/self/status");
+	fail_unless(str != 0, "/proc/self/status should be loaded successfully");
+	fail_unless(str->len > 0 && strncmp(str->data, "Name:", 5) == 0,
+		    "\"Name:\" prefix expected, got: \"%.5s\"", str->data);
+	str_free(str);
+
+	// pipe, bigger than the initial read size
+	int fds[2];
+	fail_unless(pipe(fds) == 0, "can't create a pipe");
+	char buf[10000];
+	memset(buf, 'x', sizeof(buf));
+	fail_unless(write(fds[1], buf, sizeof(buf)) == sizeof(buf),
+		    "write failed");
+	close(fds[1]);
+	str = str_from_fd(fds[0]);
+	close(fds[0]);
+	fail_unless(str->len == sizeof(buf),
+		    "%d length expected, got: %d", (int)sizeof(buf), str->len);
+	fail_unless(str->data[0] == 'x' && str->data[sizeof(buf)] == '\0',
+		    "pipe contents expected");
+	str_free(str);
+
+	// a bad fd
+	str = str_from_fd(-1);
+	fail_unless(str == 0, "zero value expected");
+}
+END_TEST
+
+START_TEST(test_str_add_fd)
+{
+	int fds[2];
+	fail_unless(pipe(fds) == 0, "can't create a pipe");
+	fail_unless(write(fds[1], "456", 3) == 3, "write failed");
+	close(fds[1]);
+
+	str_t *str = str_from_cstr("123");
+	fail_unless(str_add_fd(&str, fds[0]) == 3, "3 bytes expected");
+	CHECK_STR(str, >= 6, == 6, "123456");
+	fail_unless(str_add_fd(&str, fds[0]) == 0, "0 bytes expected");
+	close(fds[0]);
+
+	fail_unless(str_add_fd(&str, fds[0]) == -1, "error expected");
+	CHECK_STR(str, >= 6, == 6, "123456");
+	str_free(str);
+}
+END_TEST
+
+START_TEST(test_str_writev_fd)
+{
+	// more strings than fit in a single writev
+	enum { N = 3000 };
+	str_t **strs = malloc(sizeof(str_t*) * N);
+	for (int i = 0; i < N; i++)
+		strs[i] = i == 5 ? str_new(0) : i == 6 ? 0 : str_printf("%d,", i);
+	str_t *expected = str_new(0);
+	for (int i = 0; i < N; i++)
+		if (strs[i])
+			str_add_str(&expected, strs[i]);
+
+	char filename[] = "/tmp/strstr_test_XXXXXX";
+	int fd = mkstemp(filename);
+	fail_unless(fd != -1, "can't create a temporary file");
+	fail_unless(str_writev_fd(fd, (const str_t *const *)strs, N) == 0,
+		    "writev failed");
+	fail_unless(str_write_fd(fd, expected) == 0, "write failed");
+	close(fd);
+
+	str_t *str = str_from_file(filename);
+	fail_unless(str->len == expected->len * 2, "%d bytes expected, got: %d",
+		    expected->len * 2, str->len);
+	fail_unless(memcmp(str->data, expected->data, expected->len) == 0 &&
+		    memcmp(str->data + expected->len, expected->data,
+			   expected->len) == 0, "unexpected contents");
+	str_free(str);
+
+	// atomic replacement
+	fail_unless(str_writev_file(filename, (const str_t *const *)strs,
+				    3) == 0, "atomic write failed");
+	str = str_from_file(filename);
+	CHECK_STR(str, >= 6, == 6, "0,1,2,");
+	str_free(str);
+	fail_unless(str_writev_file("strstr_test.tmp", (const str_t *const *)strs,
+				    3) == 0, "atomic write without a dir failed");
+	str = str_from_file("strstr_test.tmp");
+	CHECK_STR(str, >= 6, == 6, "0,1,2,");
+	str_free(str);
+	unlink("strstr_test.tmp");
+	fail_unless(str_writev_file("/non-existent dir/file",
+				    (const str_t *const *)strs, 3) == -1 &&
+		    errno == ENOENT, "ENOENT expected");
+
+	// fstr
+	char buf1[8], buf2[8];
+	fstr_t f1, f2;
+	FSTR_INIT_FOR_BUF(&f1, buf1);
+	FSTR_INIT_FOR_BUF(&f2, buf2);
+	fstr_add_cstr(&f1, "hello, ");
+	fstr_add_cstr(&f2, "world");
+	const fstr_t *fstrs[] = {&f1, &f2};
+	fd = open(filename, O_WRONLY | O_TRUNC);
+	fail_unless(fstr_writev_fd(fd, fstrs, 2) == 0, "writev failed");
+	close(fd);
+	str = str_from_file(filename);
+	CHECK_STR(str, >= 12, == 12, "hello, world");
+	str_free(str);
+	unlink(filename);
+
+	fail_unless(str_write_fd(-1, expected) == -1 && errno == EBADF,
+		    "EBADF expected");
+	for (int i = 0; i < N; i++)
+		if (strs[i])
+			str_free(strs[i]);
+	free(strs);
+	str_free(expected);
+}
+END_TEST
+
+START_TEST(test_str_from_files)
+{
+	const char *paths[] = {
+		"testdata/file.txt",
+		"non-existent file",
+		"file.txt",
+		"/proc/self/status",
+		"testdata/file.txt",
+	};
+	const int n = sizeof(paths)/sizeof(paths[0]);
+	str_t *out[n];
+	int errors[n];
+
+	int failed = str_from_files(AT_FDCWD, paths, n, out, errors, 3);
+	fail_unless(failed == 2, "2 failures expected, got: %d", failed);
+	CHECK_STR(out[0], == 10, == 10, "123456789\n");
+	fail_unless(out[1] == 0 && errors[1] == ENOENT, "ENOENT expected");
+	fail_unless(out[2] == 0 && errors[2] == ENOENT, "ENOENT expected");
+	fail_unless(out[3] != 0 && out[3]->len > 0 && errors[3] == 0,
+		    "/proc/self/status should be loaded successfully");
+	CHECK_STR(out[4], == 10, == 10, "123456789\n");
+	str_free(out[0]);
+	str_free(out[3]);
+	str_free(out[4]);
+
+	// relative to a directory
+	int dirfd = open("testdata", O_RDONLY);
+	failed = str_from_files(dirfd, &paths[2], 1, out, 0, 0);
+	close(dirfd);
+	fail_unless(failed == 0, "0 failures expected, got: %d", failed);
+	CHECK_STR(out[0], == 10, == 10, "123456789\n");
+	str_free(out[0]);
+
+	// allocations of the worker threads are counted by the caller
+	const char *same[] = {
+		"testdata/file.txt", "testdata/file.txt", "testdata/file.txt",
+		"testdata/file.txt", "testdata/file.txt",
+	};
+	str_stats_t stats;
+	str_reset_stats();
+	failed = str_from_files(AT_FDCWD, same, n, out, 0, n);
+	fail_unless(failed == 0, "0 failures expected, got: %d", failed);
+	str_get_stats(&stats);
+#ifdef STR_STATS
+	fail_unless(stats.allocs >= 5, "at least 5 allocs expected, got: %d",
+		    (int)stats.allocs);
+#endif
+	for (int i = 0; i < n; i++)
+		str_free(out[i]);
+
+	// huge thread counts are clamped to STR_LOAD_MAX_THREADS
+	const int many = 64;
+	const char *many_paths[many];
+	str_t *many_out[many];
+	for (int i = 0; i < many; i++)
+		many_paths[i] = "testdata/file.txt";
+	failed = str_from_files(AT_FDCWD, many_paths, many, many_out, 0,
+				1 << 30);
+	fail_unless(failed == 0, "0 failures expected, got: %d", failed);
+	for (int i = 0; i < many; i++) {
+		CHECK_STR(many_out[i], == 10, == 10, "123456789\n");
+		str_free(many_out[i]);
+	}
+}
+END_TEST
+
+typedef struct loaded {
+	str_t *str;
+	int error;
+	int calls;
+} loaded_t;
+
+static void on_loaded(void *data, str_t *str, int error)
+{
+	loaded_t *l = data;
+	l->str = str;
+	l->error = error;
+	l->calls++;
+}
+
+START_TEST(test_str_loader)
+{
+	const int flags[] = {0, STR_LOADER_NO_URING};
+	for (int f = 0; f < 2; f++) {
+		// a tiny queue, submits have to wait for free slots
+		str_reset_stats();
+		str_loader_t *l = str_loader_new(2, flags[f]);
+		fail_unless(l != 0, "the loader should be created");
+
+		loaded_t files[10];
+		memset(files, 0, sizeof(files));
+		for (int i = 0; i < 9; i++) {
+			int r = str_loader_submit(l, "testdata/file.txt",
+						  on_loaded, &files[i]);
+			fail_unless(r == 0, "submit failed");
+		}
+		int r = str_loader_submit(l, "/proc/self/status",
+					  on_loaded, &files[9]);
+		fail_unless(r == 0, "submit failed");
+
+		loaded_t missing = {0, 0, 0};
+		r = str_loader_submit(l, "non-existent file",
+				      on_loaded, &missing);
+		fail_unless(r == 0 || errno == ENOENT, "ENOENT expected");
+		int n = r == 0 ? 11 : 10;
+
+		int done = 0;
+		while (str_loader_pending(l) > 0)
+			done += str_loader_poll(l, 1);
+		fail_unless(done == n, "%d loads expected, got: %d", n, done);
+		fail_unless(str_loader_poll(l, 1) == 0,
+			    "nothing should be left");
+
+		// allocations of the workers are counted by the polling thread
+		str_stats_t stats;
+		str_get_stats(&stats);
+#ifdef STR_STATS
+		fail_unless(stats.allocs >= 10,
+			    "at least 10 allocs expected, got: %d",
+			    (int)stats.allocs);
+#endif
+
+		for (int i = 0; i < 9; i++) {
+			fail_unless(files[i].calls == 1 && files[i].error == 0,
+				    "the callback should be called once");
+			CHECK_STR(files[i].str, >= 10, == 10, "123456789\n");
+			str_free(files[i].str);
+		}
+		fail_unless(files[9].str != 0 && files[9].str->len > 0,
+			    "/proc/self/status should be loaded successfully");
+		str_free(files[9].str);
+		if (r == 0)
+			fail_unless(missing.calls == 1 && missing.str == 0 &&
+				    missing.error == ENOENT, "ENOENT expected");
+
+		// loads in progress are discarded
+		str_loader_submit(l, "testdata/file.txt", on_loaded, &files[0]);
+		str_loader_free(l);
+	}
+}
+END_TEST
+
 START_TEST(test_str_add_str)
 {
 	str_t *str1 = str_from_cstr("123");
@@ -226,6 +613,7 @@ START_TEST(test_str_add_cstr_len)
 	str_add_cstr_len(&str, "12345", 0);
 	str_add_cstr_len(&str, "12345", 1);
 	str_add_cstr_len(&str, "12345", 2);
+	CHECK_STR(str, >= 3, == 3, "112");
 	str_add_cstr_len(&str, "12345", 3);
 	str_add_cstr_len(&str, "12345", 4);
 	str_add_cstr_len(&str, "12345", 5);
@@ -250,6 +638,87 @@ START_TEST(test_str_add_printf)
 }
 END_TEST
 
+START_TEST(test_str_add_numbers)
+{
+	str_t *str = str_new(0);
+	str_add_i64(&str, 0);
+	str_add_cstr(&str, " ");
+	str_add_i64(&str, -42);
+	str_add_cstr(&str, " ");
+	str_add_i64(&str, INT64_MIN);
+	str_add_cstr(&str, " ");
+	str_add_i64(&str, INT64_MAX);
+	CHECK_STR(str, >= 46, == 46,
+		"0 -42 -9223372036854775808 9223372036854775807");
+	str_free(str);
+
+	str = str_new(0);
+	str_add_u64(&str, UINT64_MAX);
+	str_add_cstr(&str, " ");
+	str_add_hex(&str, 0);
+	str_add_cstr(&str, " ");
+	str_add_hex(&str, 0xdeadbeef);
+	CHECK_STR(str, >= 31, == 31, "18446744073709551615 0 deadbeef");
+	str_free(str);
+
+	static const struct {
+		double v;
+		const char *s;
+	} doubles[] = {
+		{0.0, "0"},
+		{-0.0, "-0"},
+		{1.0, "1"},
+		{-1.5, "-1.5"},
+		{0.1, "0.1"},
+		{0.3, "0.3"},
+		{123.456, "123.456"},
+		{100.0, "100"},
+		{1e20, "100000000000000000000"},
+		{1e21, "1e+21"},
+		{0.000001, "0.000001"},
+		{1e-7, "1e-7"},
+		{1.5e-10, "1.5e-10"},
+		{5e-324, "5e-324"},
+		{1.7976931348623157e308, "1.7976931348623157e+308"},
+		{2.2250738585072014e-308, "2.2250738585072014e-308"},
+		{HUGE_VAL, "inf"},
+		{-HUGE_VAL, "-inf"},
+	};
+	for (size_t i = 0; i < sizeof(doubles)/sizeof(doubles[0]); i++) {
+		str = str_new(0);
+		str_add_double(&str, doubles[i].v);
+		fail_unless(strcmp(str->data, doubles[i].s) == 0,
+			"%s != %s", str->data, doubles[i].s);
+		fail_unless(strtod(str->data, 0) == doubles[i].v,
+			"%s doesn't round trip", str->data);
+		str_free(str);
+	}
+
+	str = str_new(0);
+	str_add_double(&str, NAN);
+	CHECK_STR(str, >= 3, == 3, "nan");
+	str_free(str);
+
+	// round trip of a few thousand doubles
+	uint64_t x = 88172645463325252ULL;
+	str = str_new(0);
+	for (int i = 0; i < 10000; i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		double v;
+		memcpy(&v, &x, sizeof(v));
+		if (isnan(v))
+			continue;
+		str_clear(str);
+		str_add_double(&str, v);
+		fail_unless(strtod(str->data, 0) == v,
+			"%s doesn't round trip", str->data);
+	}
+	str_free(str);
+}
+END_TEST
+
 START_TEST(test_str_add_file)
 {
 	str_t *str = str_from_cstr("abc");
@@ -311,6 +780,54 @@ START_TEST(test_str_trim)
 }
 END_TEST
 
+START_TEST(test_str_trim_ascii)
+{
+	// padding of every length around the SIMD block sizes, all kinds of
+	// whitespace and bytes next to them which aren't whitespace
+	const char spaces[] = " \t\n\v\f\r";
+	for (int left = 0; left < 70; left += 3) {
+		for (int right = 0; right < 70; right += 5) {
+			str_t *str = str_new(0);
+			for (int i = 0; i < left; i++)
+				str_add_cstr_len(&str, &spaces[i % 6], 1);
+			str_add_cstr(&str, "\x08" "a b\x0e\x85");
+			for (int i = 0; i < right; i++)
+				str_add_cstr_len(&str, &spaces[i % 6], 1);
+
+			int start, end;
+			str_trim_offsets(str, &start, &end);
+			fail_unless(start == left && end == left + 6,
+				    "[%d, %d) expected, got: [%d, %d)",
+				    left, left + 6, start, end);
+			strview_t v = strview_trim_ascii(strview_from_str(str));
+			fail_unless(v.data == str->data + left && v.len == 6,
+				    "unexpected view");
+
+			str_t *copy = str_dup(str);
+			str_rtrim_ascii(copy);
+			fail_unless(copy->len == left + 6, "unexpected length");
+			str_ltrim_ascii(copy);
+			CHECK_STR(copy, >= 6, == 6, "\x08" "a b\x0e\x85");
+			str_free(copy);
+
+			str_trim_ascii(str);
+			CHECK_STR(str, >= 6, == 6, "\x08" "a b\x0e\x85");
+			str_free(str);
+		}
+	}
+
+	str_t *str = str_from_cstr(" \t\n\v\f\r \t\n\v\f\r \t\n\v\f\r ");
+	int start, end;
+	str_trim_offsets(str, &start, &end);
+	fail_unless(start == end, "empty range expected");
+	str_trim_ascii(str);
+	CHECK_STR(str, >= 0, == 0, "");
+	str_trim_ascii(str);
+	CHECK_STR(str, >= 0, == 0, "");
+	str_free(str);
+}
+END_TEST
+
 START_TEST(test_str_split_path)
 {
 	str_t *str = str_from_cstr("test/path");
@@ -339,6 +856,981 @@ START_TEST(test_str_split_path)
 }
 END_TEST
 
+//-------------------------------------------------------------------------------
+// ALLOCATORS
+//-------------------------------------------------------------------------------
+
+// keeps the size of every block in front of it, to verify sized frees
+static void *sized_alloc(void *ctx, size_t size)
+{
+	size_t *p = debug_malloc(sizeof(size_t) + size);
+	*p = size;
+	(*(int*)ctx)++;
+	return p + 1;
+}
+
+static void sized_free(void *ctx, void *ptr, size_t size)
+{
+	size_t *p = (size_t*)ptr - 1;
+	fail_unless(*p == size, "%d size expected, got: %d", (int)*p, (int)size);
+	debug_free(p);
+}
+
+static size_t sized_good_size(void *ctx, size_t size)
+{
+	return (size + 15) & ~15;
+}
+
+START_TEST(test_str_allocator2)
+{
+	int n = 0;
+	str_allocator2_t alloc = {
+		&n,
+		sized_alloc,
+		sized_free,
+		0,
+		sized_good_size
+	};
+	str_allocator_t v1;
+
+	str_allocator2_t cur;
+	str_set_allocator2(&alloc);
+	str_get_allocator2(&cur);
+	fail_unless(cur.ctx == &n && cur.alloc == sized_alloc,
+		    "the same allocator expected");
+
+	str_t *str = str_new(10);
+	CHECK_STR(str, == 32 - 8 - 1, == 0, "");
+	str_add_cstr(&str, "0123456789012345678901234567890123456789");
+	CHECK_STR(str, >= 40, == 40,
+		  "0123456789012345678901234567890123456789");
+	str_free(str);
+	fail_unless(n == 2, "2 allocations expected, got: %d", n);
+
+	// the old interface goes through the adapter
+	setup_debug_allocator();
+	str_get_allocator(&v1);
+	fail_unless(v1.malloc == debug_malloc && v1.free == debug_free,
+		    "debug allocator expected");
+
+	// a str_allocator2_t saved and restored through the old interface
+	n = 0;
+	str_set_allocator2(&alloc);
+	str_get_allocator(&v1);
+	setup_debug_allocator();
+	str_set_allocator(&v1);
+	str_get_allocator2(&cur);
+	fail_unless(cur.ctx == &n && cur.alloc == sized_alloc,
+		    "the same allocator expected");
+	str = str_from_cstr("abc");
+	str_free(str);
+	char *p = (*v1.malloc)(10);
+	memcpy(p, "0123456789", 10);
+	(*v1.free)(p);
+	fail_unless(n == 2, "2 allocations expected, got: %d", n);
+	setup_debug_allocator();
+}
+END_TEST
+
+START_TEST(test_str_arena)
+{
+	str_allocator2_t old, alloc;
+	str_arena_t arena;
+
+	str_get_allocator2(&old);
+	str_arena_init(&arena, 64);
+	str_arena_get_allocator(&arena, &alloc);
+	str_set_allocator2(&alloc);
+
+	str_t *str1 = str_from_cstr("hello");
+	str_add_cstr(&str1, ", world");
+	CHECK_STR(str1, >= 12, == 12, "hello, world");
+	str_free(str1); // no-op
+
+	// nested scope, everything allocated after the mark goes away, but
+	// the outer strings are intact
+	str_arena_mark_t m = str_arena_mark(&arena);
+	str_t *str2 = str_new(0);
+	for (int i = 0; i < 100; i++)
+		str_add_printf(&str2, "%d", i % 10);
+	fail_unless(str2->len == 100, "100 length expected, got: %d", str2->len);
+	str_arena_release(&arena, m);
+
+	// the last allocation grows in place
+	str2 = str_new(0);
+	str_t *str5 = str2;
+	str_add_cstr(&str2, "0123456789");
+	fail_unless(str2 == str5, "the string should grow in place");
+	str_arena_release(&arena, m);
+	CHECK_STR(str1, >= 12, == 12, "hello, world");
+
+	// and shrinks in place, the tail is given back
+	char *p = (*alloc.alloc)(alloc.ctx, 48);
+	fail_unless((*alloc.resize)(alloc.ctx, p, 48, 16) == p,
+		    "the block should shrink in place");
+	fail_unless((*alloc.alloc)(alloc.ctx, 16) == p + 16,
+		    "the tail should be reused");
+
+	// blocks are reused after reset
+	str_arena_reset(&arena);
+	str_t *str3 = str_from_cstr("nsf");
+	str_arena_reset(&arena);
+	str_t *str4 = str_from_cstr("fsn");
+	fail_unless(str3 == str4, "memory should be reused after reset");
+	CHECK_STR(str4, == 3, == 3, "fsn");
+
+	str_set_allocator2(&old);
+	str_arena_free(&arena);
+}
+END_TEST
+
+START_TEST(test_str_pool)
+{
+	str_allocator2_t old, alloc;
+
+	str_get_allocator2(&old);
+	str_pool_get_allocator(&alloc);
+	str_set_allocator2(&alloc);
+
+	// 8 + 10 + 1 bytes, rounded up to the 32 bytes size class
+	str_t *str1 = str_new(10);
+	CHECK_STR(str1, == 32 - 8 - 1, == 0, "");
+	str_free(str1);
+
+	// freed blocks are reused
+	str_t *str2 = str_from_cstr("helloworld");
+	fail_unless(str1 == str2, "memory should be reused");
+	CHECK_STR(str2, == 32 - 8 - 1, == 10, "helloworld");
+
+	// growing through size classes and beyond them
+	for (int i = 0; i < 100; i++)
+		str_add_cstr(&str2, "12345");
+	fail_unless(str2->len == 510, "510 length expected, got: %d", str2->len);
+	fail_unless(strncmp(str2->data, "helloworld12345", 15) == 0,
+		    "\"helloworld12345\" prefix expected, got: \"%.15s\"",
+		    str2->data);
+	str_free(str2);
+
+	str_set_allocator2(&old);
+}
+END_TEST
+
+static void *pool_thread_free(void *str)
+{
+	str_allocator2_t alloc;
+	str_pool_get_allocator(&alloc);
+	str_set_allocator2(&alloc);
+	str_free(str);
+	return 0;
+}
+
+static void *default_thread_free(void *str)
+{
+	str_free(str);
+	return 0;
+}
+
+static void *default_thread_grow(void *str)
+{
+	str_add_cstr((str_t**)&str, "1234567890");
+	return str;
+}
+
+static void *pool_thread_new(void *arg)
+{
+	str_allocator2_t alloc;
+	str_pool_get_allocator(&alloc);
+	str_set_allocator2(&alloc);
+	return str_from_cstr("producer");
+}
+
+START_TEST(test_str_pool_threads)
+{
+	str_allocator2_t old, alloc;
+	pthread_t t;
+
+	str_get_allocator2(&old);
+	str_pool_get_allocator(&alloc);
+	str_set_allocator2(&alloc);
+
+	// freed by another thread, comes back to the owner when its free list
+	// runs dry
+	str_t *str = str_from_cstr("nsf");
+	pthread_create(&t, 0, pool_thread_free, str);
+	pthread_join(t, 0);
+
+	str_t *strs[5000];
+	int found = 0, n = 0;
+	while (n < 5000 && !found) {
+		strs[n] = str_from_cstr("fsn");
+		found = strs[n++] == str;
+	}
+	fail_unless(found, "remotely freed block should be reused");
+	for (int i = 0; i < n; i++)
+		str_free(strs[i]);
+
+	// the same with the default allocator in the other thread
+	str = str_from_cstr("nsf");
+	pthread_create(&t, 0, default_thread_free, str);
+	pthread_join(t, 0);
+	found = n = 0;
+	while (n < 5000 && !found) {
+		strs[n] = str_from_cstr("fsn");
+		found = strs[n++] == str;
+	}
+	fail_unless(found, "block freed with the default allocator should "
+		    "be reused");
+	for (int i = 0; i < n; i++)
+		str_free(strs[i]);
+
+	// growing with the default allocator moves the string out of the pool
+	void *ret;
+	str = str_from_cstr("nsf");
+	pthread_create(&t, 0, default_thread_grow, str);
+	pthread_join(t, &ret);
+	CHECK_STR((str_t*)ret, >= 13, == 13, "nsf1234567890");
+	str_free(ret);
+
+	// the producer exits before the string is freed
+	pthread_create(&t, 0, pool_thread_new, 0);
+	pthread_join(t, &ret);
+	str = ret;
+	CHECK_STR(str, >= 8, == 8, "producer");
+	str_free(str);
+
+	str_set_allocator2(&old);
+}
+END_TEST
+
+//-------------------------------------------------------------------------------
+// STATS
+//-------------------------------------------------------------------------------
+
+#define CHECK_STAT(stats, field, value)						\
+	fail_unless((stats).field == (value),					\
+		    #field ": %d expected, got: %d",				\
+		    (int)(value), (int)(stats).field)
+
+START_TEST(test_str_stats)
+{
+	str_stats_t stats;
+
+	str_reset_stats();
+	str_t *str = str_new(10);
+	str_add_cstr(&str, "0123456789012"); // regrow to 20 bytes
+	str_add_printf(&str, "%d", 1);
+	str_free(str);
+
+	str_get_stats(&stats);
+#ifdef STR_STATS
+	CHECK_STAT(stats, allocs, 2);
+	CHECK_STAT(stats, frees, 2);
+	CHECK_STAT(stats, bytes_requested, 2*8 + 10 + 20 + 2);
+	CHECK_STAT(stats, bytes_slack, 20 - 14);
+	CHECK_STAT(stats, regrows, 1);
+	CHECK_STAT(stats, regrow_bytes_copied, 1);
+	CHECK_STAT(stats, printf_double_passes, 1);
+
+	// an istr spilling to the heap in printf counts the second pass too
+	char buf[4];
+	istr_t istr;
+	ISTR_INIT_FOR_BUF(&istr, buf);
+	str_reset_stats();
+	istr_add_printf(&istr, "%d", 123456);
+	istr_free(&istr);
+	str_get_stats(&stats);
+	CHECK_STAT(stats, printf_double_passes, 1);
+
+	str_reset_stats();
+	str_get_stats(&stats);
+#endif
+	CHECK_STAT(stats, allocs, 0);
+	CHECK_STAT(stats, regrows, 0);
+
+	// growing with 'resize' counts only the growth
+	str_allocator2_t old, pool;
+	str_get_allocator2(&old);
+	str_pool_get_allocator(&pool);
+	str_set_allocator2(&pool);
+	str_reset_stats();
+	str = str_new(10);
+	str_add_printf(&str, "%0100d", 0);
+	str_get_stats(&stats);
+	size_t size = sizeof(str_t) + str->cap + 1;
+	str_free(str);
+	str_set_allocator2(&old);
+#ifdef STR_STATS
+	CHECK_STAT(stats, regrows, 1);
+	CHECK_STAT(stats, bytes_requested, size);
+#else
+	(void)size;
+#endif
+}
+END_TEST
+
+//-------------------------------------------------------------------------------
+// MSTR
+//-------------------------------------------------------------------------------
+
+START_TEST(test_mstr_from_file)
+{
+	mstr_t *mstr = mstr_from_file("testdata/file.txt", MSTR_SEQUENTIAL);
+	fail_unless(mstr != 0, "testdata/file.txt should be mapped successfully");
+	fail_unless(mstr->len == 10, "10 length expected, got: %d",
+		    (int)mstr->len);
+	fail_unless(strcmp(mstr->data, "123456789\n") == 0,
+		    "\"123456789\\n\" string data expected, got: \"%s\"",
+		    mstr->data);
+	mstr_free(mstr);
+
+	mstr = mstr_from_file("non-existent file", MSTR_NORMAL);
+	fail_unless(mstr == 0, "zero value expected");
+
+	// the size is a multiple of the page size, still zero-terminated
+	char filename[] = "/tmp/strstr_test_XXXXXX";
+	int fd = mkstemp(filename);
+	fail_unless(fd != -1, "can't create a temporary file");
+	long ps = sysconf(_SC_PAGESIZE);
+	char *page = malloc(ps);
+	memset(page, 'x', ps);
+	fail_unless(write(fd, page, ps) == ps, "write failed");
+	close(fd);
+	free(page);
+
+	mstr = mstr_from_file(filename, MSTR_RANDOM);
+	unlink(filename);
+	fail_unless(mstr != 0, "the file should be mapped successfully");
+	fail_unless(mstr->len == ps, "%d length expected, got: %d",
+		    (int)ps, (int)mstr->len);
+	fail_unless(mstr->data[ps - 1] == 'x' && mstr->data[ps] == '\0',
+		    "zero termination expected");
+	mstr_free(mstr);
+}
+END_TEST
+
+//-------------------------------------------------------------------------------
+// LREADER
+//-------------------------------------------------------------------------------
+
+START_TEST(test_lreader)
+{
+	const char *line;
+	int len;
+
+	lreader_t *r = lreader_open("testdata/file.txt", 0);
+	fail_unless(r != 0, "testdata/file.txt should be opened successfully");
+	fail_unless(lreader_next(r, &line, &len) == 1, "a line expected");
+	fail_unless(len == 9 && strcmp(line, "123456789") == 0,
+		    "\"123456789\" expected, got: \"%s\"", line);
+	fail_unless(lreader_next(r, &line, &len) == 0, "the end expected");
+	fail_unless(lreader_next(r, &line, &len) == 0, "the end expected");
+	lreader_close(r);
+
+	r = lreader_open("non-existent file", 0);
+	fail_unless(r == 0, "zero value expected");
+}
+END_TEST
+
+START_TEST(test_lreader_chunks)
+{
+	// lines cross chunk boundaries, some are longer than a chunk, the
+	// last one has no newline
+	const char *lines[] = {
+		"", "a", "bc", "", "defghijklmnopqrstuvwxyz", "12345", "6", "7"
+	};
+	const int n = sizeof(lines)/sizeof(lines[0]);
+
+	char filename[] = "/tmp/strstr_test_XXXXXX";
+	int fd = mkstemp(filename);
+	fail_unless(fd != -1, "can't create a temporary file");
+	for (int i = 0; i < n; i++) {
+		int len = strlen(lines[i]);
+		fail_unless(write(fd, lines[i], len) == len, "write failed");
+		if (i != n - 1)
+			fail_unless(write(fd, "\n", 1) == 1, "write failed");
+	}
+	close(fd);
+
+	for (int chunk = 1; chunk < 10; chunk++) {
+		lreader_t *r = lreader_open(filename, chunk);
+		const char *line;
+		int len, i = 0;
+		while (lreader_next(r, &line, &len) == 1) {
+			fail_unless(i < n, "too many lines");
+			fail_unless(len == strlen(lines[i]) &&
+				    strcmp(line, lines[i]) == 0,
+				    "chunk %d: \"%s\" expected, got: \"%s\"",
+				    chunk, lines[i], line);
+			i++;
+		}
+		fail_unless(i == n, "%d lines expected, got: %d", n, i);
+		lreader_close(r);
+	}
+	unlink(filename);
+}
+END_TEST
+
+//-------------------------------------------------------------------------------
+// TSTR
+//-------------------------------------------------------------------------------
+
+#define CHECK_TSTR(tstr, _len, _data)						\
+do {										\
+	fail_unless(tstr_len(tstr) == _len,					\
+		    #_len " length expected, got: %d", tstr_len(tstr));	\
+	fail_unless(strcmp(tstr_data(tstr), _data) == 0,			\
+		    "\"" _data "\" string data expected, got: \"%s\"",		\
+		    tstr_data(tstr));						\
+} while (0)
+
+START_TEST(test_tstr)
+{
+	tstr_t *tstr = tstr_from_cstr("sym");
+	CHECK_TSTR(tstr, 3, "sym");
+	fail_unless(tstr_data(tstr) == (const char*)tstr + 1,
+		    "1 byte length expected");
+	tstr_free(tstr);
+
+	tstr = tstr_from_cstr("");
+	CHECK_TSTR(tstr, 0, "");
+	tstr_free(tstr);
+
+	// 2 bytes length
+	str_t *str = str_new(200);
+	for (int i = 0; i < 20; i++)
+		str_add_cstr(&str, "0123456789");
+	tstr = tstr_from_str(str);
+	fail_unless(tstr_len(tstr) == 200,
+		    "200 length expected, got: %d", tstr_len(tstr));
+	fail_unless(tstr_data(tstr) == (const char*)tstr + 2,
+		    "2 bytes length expected");
+	str_free(str);
+
+	str = str_from_tstr(tstr);
+	fail_unless(str->len == 200, "200 length expected, got: %d", str->len);
+	fail_unless(strcmp(str->data, tstr_data(tstr)) == 0,
+		    "the same data expected");
+	str_free(str);
+	tstr_free(tstr);
+}
+END_TEST
+
+//-------------------------------------------------------------------------------
+// RSTR
+//-------------------------------------------------------------------------------
+
+START_TEST(test_rstr_add)
+{
+	rstr_t r;
+	rstr_init(&r, 8);
+	rstr_add_printf(&r, "%s", "");
+	rstr_add_cstr(&r, "hello");
+	rstr_add_cstr(&r, ", world! ");
+	rstr_add_printf(&r, "%d-%d", 12345, 67890);
+	str_t *s = str_from_cstr(" and a str longer than a chunk");
+	rstr_add_str(&r, s);
+	str_free(s);
+	fail_unless(r.len == 55, "55 bytes expected, got: %d", (int)r.len);
+
+	s = rstr_to_str(&r);
+	CHECK_STR(s, >= 55, == 55,
+		  "hello, world! 12345-67890 and a str longer than a chunk");
+	str_free(s);
+
+	// streamed without flattening
+	char filename[] = "/tmp/strstr_test_XXXXXX";
+	int fd = mkstemp(filename);
+	fail_unless(fd != -1, "can't create a temporary file");
+	fail_unless(rstr_write_fd(&r, fd) == 0, "write failed");
+	close(fd);
+	s = str_from_file(filename);
+	unlink(filename);
+	CHECK_STR(s, >= 55, == 55,
+		  "hello, world! 12345-67890 and a str longer than a chunk");
+	str_free(s);
+
+	rstr_clear(&r);
+	fail_unless(r.len == 0 && r.head == r.tail, "one chunk should be kept");
+	s = rstr_to_str(&r);
+	CHECK_STR(s, >= 0, == 0, "");
+	str_free(s);
+
+	rstr_add_printf(&r, "%0*d", 20, 1);
+	s = rstr_to_str(&r);
+	CHECK_STR(s, >= 20, == 20, "00000000000000000001");
+	str_free(s);
+	rstr_free(&r);
+}
+END_TEST
+
+//-------------------------------------------------------------------------------
+// SPACK
+//-------------------------------------------------------------------------------
+
+static void write_file(int dirfd, const char *path, const char *contents)
+{
+	int fd = openat(dirfd, path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	fail_unless(fd != -1, "can't create %s", path);
+	int len = strlen(contents);
+	fail_unless(write(fd, contents, len) == len, "write failed");
+	close(fd);
+}
+
+START_TEST(test_spack)
+{
+	char dir[] = "/tmp/strstr_test_XXXXXX";
+	fail_unless(mkdtemp(dir) != 0, "can't create a temporary directory");
+	int dirfd = open(dir, O_RDONLY);
+	mkdirat(dirfd, "sub", 0755);
+	write_file(dirfd, "b.txt", "bbb");
+	write_file(dirfd, "a.txt", "");
+	write_file(dirfd, "sub/c.txt", "123456789");
+
+	char archive[] = "/tmp/strstr_test_XXXXXX";
+	int fd = mkstemp(archive);
+	fail_unless(fd != -1, "can't create a temporary file");
+	close(fd);
+	fail_unless(spack_write_dir(archive, AT_FDCWD, dir) == 0,
+		    "packing failed");
+
+	unlinkat(dirfd, "sub/c.txt", 0);
+	unlinkat(dirfd, "sub", AT_REMOVEDIR);
+	unlinkat(dirfd, "a.txt", 0);
+	unlinkat(dirfd, "b.txt", 0);
+	close(dirfd);
+	rmdir(dir);
+
+	spack_t *p = spack_open(archive);
+	fail_unless(p != 0, "the archive should be opened");
+	fail_unless(spack_count(p) == 3, "3 files expected, got: %d",
+		    spack_count(p));
+
+	const char *expected[][2] = {
+		{"a.txt", ""},
+		{"b.txt", "bbb"},
+		{"sub/c.txt", "123456789"},
+	};
+	for (int i = 0; i < 3; i++) {
+		int len;
+		const char *path;
+		const char *data = spack_get(p, i, &path, &len);
+		fail_unless(strcmp(path, expected[i][0]) == 0,
+			    "'%s' expected, got: '%s'", expected[i][0], path);
+		fail_unless(((uintptr_t)data & 7) == 0,
+			    "the payload should be 8-byte aligned");
+		fail_unless(len == (int)strlen(expected[i][1]) &&
+			    strcmp(data, expected[i][1]) == 0,
+			    "unexpected contents of %s", path);
+		fail_unless(spack_find(p, expected[i][0], &len) == data,
+			    "%s should be found", path);
+	}
+	fail_unless(spack_find(p, "sub", 0) == 0, "no such file");
+	fail_unless(spack_find(p, "c.txt", 0) == 0, "no such file");
+	fail_unless(spack_find(p, "z", 0) == 0, "no such file");
+	spack_close(p);
+
+	// duplicates
+	str_t *s = str_from_cstr("x");
+	const char *paths[] = {"x", "y", "x"};
+	const str_t *strs[] = {s, s, s};
+	fail_unless(spack_write(archive, paths, strs, 3) == -1 &&
+		    errno == EINVAL, "EINVAL expected");
+	fail_unless(spack_write(archive, paths, strs, 2) == 0,
+		    "packing failed");
+	str_free(s);
+	p = spack_open(archive);
+	int len = 0;
+	const char *data = spack_find(p, "y", &len);
+	fail_unless(data && len == 1 && data[0] == 'x', "y should be found");
+	spack_close(p);
+	unlink(archive);
+
+	fail_unless(spack_open("testdata/file.txt") == 0 && errno == EINVAL,
+		    "EINVAL expected");
+	fail_unless(spack_write_dir(archive, AT_FDCWD, "non-existent dir")
+		    == -1 && errno == ENOENT, "ENOENT expected");
+}
+END_TEST
+
+//-------------------------------------------------------------------------------
+// LSTR
+//-------------------------------------------------------------------------------
+
+START_TEST(test_lstr)
+{
+	lstr_t *l = lstr_new(0);
+	lstr_add_cstr(&l, "hello");
+	str_t *s = str_from_cstr(", world");
+	lstr_add_str(&l, s);
+	str_free(s);
+	for (int i = 0; i < 1000; i++)
+		lstr_add_printf(&l, "%03d", i);
+	fail_unless(l->len == 12 + 3000, "%d bytes expected, got: %d",
+		    12 + 3000, (int)l->len);
+	fail_unless(memcmp(l->data, "hello, world000001", 18) == 0 &&
+		    strcmp(l->data + l->len - 3, "999") == 0,
+		    "unexpected contents");
+
+	char filename[] = "/tmp/strstr_test_XXXXXX";
+	int fd = mkstemp(filename);
+	fail_unless(fd != -1, "can't create a temporary file");
+	fail_unless(lstr_write_fd(fd, l) == 0, "write failed");
+	close(fd);
+
+	lstr_t *l2 = lstr_from_file(filename);
+	fail_unless(l2 && l2->len == l->len &&
+		    memcmp(l2->data, l->data, l->len + 1) == 0,
+		    "the file should be read back");
+	fd = open(filename, O_RDONLY);
+	fail_unless(lstr_add_fd(&l2, fd) == (ptrdiff_t)l->len, "read failed");
+	close(fd);
+	fail_unless(l2->len == l->len * 2, "the file should be appended");
+	lstr_add_lstr(&l, l2);
+	fail_unless(l->len == l2->len + l2->len / 2, "unexpected length");
+	lstr_clear(l2);
+	fail_unless(l2->len == 0 && l2->data[0] == '\0', "should be empty");
+	lstr_free(l2);
+	lstr_free(l);
+
+	// too big for a str_t, the size is checked before allocating
+	fd = open(filename, O_WRONLY);
+	fail_unless(ftruncate(fd, (off_t)3 << 30) == 0, "ftruncate failed");
+	close(fd);
+	fail_unless(str_from_file(filename) == 0 && errno == EFBIG,
+		    "EFBIG expected");
+	unlink(filename);
+}
+END_TEST
+
+//-------------------------------------------------------------------------------
+// LINDEX
+//-------------------------------------------------------------------------------
+
+START_TEST(test_lindex)
+{
+	// line i is i % 23 copies of 'a' + i % 26, some of them are empty
+	str_t *text = str_new(0);
+	const int n = 1000;
+	for (int i = 0; i < n; i++) {
+		for (int j = 0; j < i % 23; j++)
+			str_add_printf(&text, "%c", 'a' + i % 26);
+		if (i != n - 1)
+			str_add_cstr(&text, "\n");
+	}
+
+	lindex_t idx;
+	lindex_init(&idx);
+	fail_unless(lindex_lines(&idx) == 0, "no lines expected");
+
+	// incrementally, in pieces of different sizes
+	size_t len = 0;
+	for (int step = 1; len < (size_t)text->len; step = step * 3 + 1) {
+		len += step;
+		if (len > (size_t)text->len)
+			len = text->len;
+		lindex_update(&idx, text->data, len);
+	}
+	fail_unless(lindex_lines(&idx) == (size_t)n, "%d lines expected, "
+		    "got: %d", n, (int)lindex_lines(&idx));
+
+	for (int i = 0; i < n; i++) {
+		const char *line;
+		size_t line_len;
+		fail_unless(lindex_line(&idx, text->data, i, &line, &line_len),
+			    "line %d should be found", i);
+		fail_unless(line_len == (size_t)(i % 23),
+			    "line %d: length %d expected, got: %d",
+			    i, i % 23, (int)line_len);
+		for (size_t j = 0; j < line_len; j++)
+			fail_unless(line[j] == 'a' + i % 26,
+				    "line %d: unexpected contents", i);
+	}
+	fail_unless(!lindex_line(&idx, text->data, n, 0, 0), "no such line");
+
+	// a trailing newline doesn't start a line
+	str_add_cstr(&text, "\n");
+	lindex_update(&idx, text->data, text->len);
+	fail_unless(lindex_lines(&idx) == (size_t)n, "%d lines expected", n);
+	str_add_cstr(&text, "x");
+	lindex_update(&idx, text->data, text->len);
+	fail_unless(lindex_lines(&idx) == (size_t)n + 1, "%d lines expected",
+		    n + 1);
+	const char *line;
+	size_t line_len;
+	fail_unless(lindex_line(&idx, text->data, n, &line, &line_len) &&
+		    line_len == 1 && line[0] == 'x', "the last line is 'x'");
+
+	lindex_free(&idx);
+	str_free(text);
+}
+END_TEST
+
+//-------------------------------------------------------------------------------
+// STRVIEW
+//-------------------------------------------------------------------------------
+
+#define CHECK_VIEW(v, expected) \
+	fail_unless(strview_eq(v, strview_from_cstr(expected)), \
+		    "'%s' expected, got: '%.*s'", expected, (int)(v).len, (v).data)
+
+START_TEST(test_strview)
+{
+	str_t *str = str_from_cstr("  key = value ; x  ");
+	strview_t v = strview_from_str(str), head, tail;
+	CHECK_VIEW(strview_trim(v), "key = value ; x");
+	CHECK_VIEW(strview_ltrim(v), "key = value ; x  ");
+	CHECK_VIEW(strview_rtrim(v), "  key = value ; x");
+	CHECK_VIEW(strview_trim(strview("   ", 3)), "");
+
+	fail_unless(strview_split(v, '=', &head, &tail), "'=' expected");
+	CHECK_VIEW(strview_trim(head), "key");
+	CHECK_VIEW(strview_trim(tail), "value ; x");
+	fail_unless(!strview_split(v, '#', &head, &tail), "no '#' expected");
+	fail_unless(head.data == v.data && head.len == v.len && tail.len == 0,
+		    "the whole view expected");
+
+	fail_unless(strview_find(v, strview_from_cstr("value")) == 8,
+		    "offset 8 expected");
+	fail_unless(strview_find(v, strview_from_cstr("values")) == -1,
+		    "-1 expected");
+	fail_unless(strview_find_char(v, ';') == 14, "offset 14 expected");
+	fail_unless(strview_cmp(strview_from_cstr("ab"),
+				strview_from_cstr("abc")) < 0, "ab < abc");
+	fail_unless(strview_cmp(strview_from_cstr("b"),
+				strview_from_cstr("abc")) > 0, "b > abc");
+
+	// tokens point into the original buffer
+	const char *tokens[] = {"key", "=", "value", "x"};
+	strview_t rest = v, tok;
+	int n = 0;
+	while (strview_next_token(&rest, " ;", &tok)) {
+		fail_unless(n < 4, "too many tokens");
+		CHECK_VIEW(tok, tokens[n]);
+		fail_unless(tok.data >= str->data &&
+			    tok.data < str->data + str->len, "not a view");
+		n++;
+	}
+	fail_unless(n == 4, "4 tokens expected, got: %d", n);
+
+	str_t *copy = str_from_strview(strview_trim(v));
+	str_add_strview(&copy, strview("!?", 1));
+	CHECK_STR(copy, >= 16, == 16, "key = value ; x!");
+	str_free(copy);
+	str_free(str);
+
+	char buf[16];
+	fstr_t f;
+	FSTR_INIT_FOR_BUF(&f, buf);
+	fstr_add_cstr(&f, "a/b/c");
+	strview_t dir, file;
+	fail_unless(strview_split_path(strview_from_fstr(&f), &dir, &file),
+		    "a directory part expected");
+	CHECK_VIEW(dir, "a/b");
+	CHECK_VIEW(file, "c");
+	fail_unless(!strview_split_path(strview_from_cstr("/c"), &dir, &file),
+		    "no directory part expected");
+	CHECK_VIEW(file, "/c");
+	fail_unless(!strview_split_path(strview("", 0), &dir, &file),
+		    "no directory part expected");
+}
+END_TEST
+
+//-------------------------------------------------------------------------------
+// SEARCH
+//-------------------------------------------------------------------------------
+
+START_TEST(test_str_find)
+{
+	str_t *str = str_from_cstr("abcabcab_abc");
+	fail_unless(str_find(str, "abc", 3) == 0, "0 expected");
+	fail_unless(str_rfind(str, "abc", 3) == 9, "9 expected");
+	fail_unless(str_find(str, "cab_", 4) == 5, "5 expected");
+	fail_unless(str_find(str, "abd", 3) == -1, "-1 expected");
+	fail_unless(str_find(str, "", 0) == 0, "0 expected");
+	fail_unless(str_rfind(str, "", 0) == 12, "12 expected");
+	fail_unless(str_find(str, "abcabcab_abcX", 13) == -1, "-1 expected");
+	fail_unless(str_find_char(str, '_') == 8, "8 expected");
+	fail_unless(str_find_char(str, 'x') == -1, "-1 expected");
+	fail_unless(str_count(str, "abc", 3) == 3, "3 expected");
+	fail_unless(str_count(str, "ab", 2) == 4, "4 expected");
+	fail_unless(str_count(str, "", 0) == 0, "0 expected");
+
+	// bounded by the length, zero bytes are regular ones
+	str_add_cstr_len(&str, "\0zz", 3);
+	fail_unless(str_find(str, "c\0zz", 4) == 11, "11 expected");
+	fail_unless(str_find(str, "zz\0", 3) == -1, "-1 expected");
+	fail_unless(str_find_char(str, '\0') == 12, "12 expected");
+	fail_unless(str_rfind(str, "\0", 1) == 12, "12 expected");
+	fail_unless(str_rfind(str, "c", 1) == 11, "11 expected");
+	str_free(str);
+
+	// long needles, many candidate positions, past the SIMD blocks
+	str = str_new(0);
+	for (int i = 0; i < 100000; i++)
+		str_add_cstr(&str, "a");
+	char needle[101];
+	memset(needle, 'a', 100);
+	needle[50] = 'b';
+	needle[100] = '\0';
+	fail_unless(str_find(str, needle, 100) == -1, "-1 expected");
+	fail_unless(str_rfind(str, needle, 100) == -1, "-1 expected");
+	fail_unless(str_find(str, "aaaaba", 6) == -1, "-1 expected");
+	str->data[50000] = 'b';
+	fail_unless(str_find(str, needle, 100) == 49950, "49950 expected");
+	fail_unless(str_rfind(str, needle, 100) == 49950, "49950 expected");
+	fail_unless(str_find(str, "aaaaba", 6) == 49996, "49996 expected");
+	fail_unless(str_rfind(str, "abaaaa", 6) == 49999, "49999 expected");
+	fail_unless(str_rfind(str, "b", 1) == 50000, "50000 expected");
+	fail_unless(str_rfind(str, "x", 1) == -1, "-1 expected");
+	fail_unless(str_count(str, "aaaa", 4) == 24999, "24999 expected");
+	str_free(str);
+
+	char buf[32];
+	fstr_t f;
+	FSTR_INIT_FOR_BUF(&f, buf);
+	fstr_add_cstr(&f, "one two three two one");
+	fail_unless(fstr_find(&f, "two", 3) == 4, "4 expected");
+	fail_unless(fstr_rfind(&f, "two", 3) == 14, "14 expected");
+	fail_unless(fstr_find_char(&f, 'h') == 9, "9 expected");
+	fail_unless(fstr_count(&f, "one", 3) == 2, "2 expected");
+
+	strview_t v = strview_from_fstr(&f);
+	fail_unless(strview_rfind(v, strview_from_cstr("one")) == 18,
+		    "18 expected");
+	fail_unless(str_count_mem(f.data, 3, "o", 1) == 1, "1 expected");
+}
+END_TEST
+
+//-------------------------------------------------------------------------------
+// ACM
+//-------------------------------------------------------------------------------
+
+typedef struct acm_matches {
+	char buf[256];
+	int n;
+} acm_matches_t;
+
+static int collect_match(void *data, int id, size_t start, size_t end)
+{
+	acm_matches_t *m = data;
+	m->n += snprintf(m->buf + m->n, sizeof(m->buf) - m->n, "%d:%d-%d ",
+			 id, (int)start, (int)end);
+	return 0;
+}
+
+static int stop_match(void *data, int id, size_t start, size_t end)
+{
+	return 1;
+}
+
+START_TEST(test_acm)
+{
+	acm_t *a = acm_new();
+	fail_unless(acm_add(a, "he", 2) == 0, "id 0 expected");
+	fail_unless(acm_add(a, "she", 3) == 1, "id 1 expected");
+	fail_unless(acm_add(a, "his", 3) == 2, "id 2 expected");
+	fail_unless(acm_add(a, "hers", 4) == 3, "id 3 expected");
+	fail_unless(acm_add(a, "\xff\0", 2) == 4, "id 4 expected");
+	fail_unless(acm_add(a, "he", 2) == 5, "id 5 expected");
+	acm_compile(a);
+	fail_unless(acm_patterns(a) == 6, "6 patterns expected");
+
+	// all matches, overlapping ones too
+	const char text[] = "ushers \xff\0 this";
+	acm_matches_t m = {"", 0};
+	size_t n = acm_find_all(a, text, sizeof(text) - 1, collect_match, &m);
+	fail_unless(n == 5, "5 matches expected, got: %d", (int)n);
+	fail_unless(strcmp(m.buf, "1:1-4 0:2-4 3:2-6 4:7-9 2:11-14 ") == 0,
+		    "unexpected matches: %s", m.buf);
+	fail_unless(acm_find_all(a, text, sizeof(text) - 1, stop_match, 0) == 1,
+		    "the search should stop");
+	fail_unless(acm_find_all(a, text, 2, 0, 0) == 0, "no matches expected");
+
+	// leftmost, then longest
+	strview_t repl[] = {
+		strview("1", 1), strview("2", 1), strview("3", 1),
+		strview("", 0), strview("<0>", 3), strview("6", 1),
+	};
+	str_t *str = str_from_cstr_len(text, sizeof(text) - 1);
+	str_t *out = str_replace_all(str, a, repl);
+	CHECK_STR(out, >= 11, == 11, "u2rs <0> t3");
+	str_free(out);
+	str_free(str);
+	acm_free(a);
+
+	// a long pattern in progress hides short ones which are replaced
+	// after all
+	a = acm_new();
+	acm_add(a, "ab", 2);
+	acm_add(a, "cd", 2);
+	acm_add(a, "abcdef", 6);
+	acm_add(a, "bc", 2);
+	acm_compile(a);
+	strview_t repl2[] = {
+		strview("X", 1), strview("Y", 1), strview("Z", 1),
+		strview("W", 1),
+	};
+	str = str_from_cstr("abcdX abcdef abcde bcd");
+	out = str_replace_all(str, a, repl2);
+	CHECK_STR(out, >= 12, == 12, "XYX Z XYe Wd");
+	str_free(out);
+
+	// the result is the only allocation
+	int nallocs = 0;
+	str_allocator2_t old, counting = {
+		&nallocs, sized_alloc, sized_free, 0, 0
+	};
+	str_get_allocator2(&old);
+	str_set_allocator2(&counting);
+	out = str_replace_all(str, a, repl2);
+	CHECK_STR(out, >= 12, == 12, "XYX Z XYe Wd");
+	str_free(out);
+	str_set_allocator2(&old);
+	fail_unless(nallocs == 1, "1 allocation expected, got: %d", nallocs);
+
+	// no matches, still a copy
+	str_clear(str);
+	str_add_cstr(&str, "nothing");
+	out = str_replace_all(str, a, repl2);
+	fail_unless(out != str, "a copy expected");
+	CHECK_STR(out, >= 7, == 7, "nothing");
+	str_free(out);
+	str_free(str);
+	acm_free(a);
+
+	// a long pattern sharing a prefix with a short one, the short matches
+	// are replaced without scanning the text again after each of them
+	char *longp = malloc(1000);
+	memset(longp, 'a', 999);
+	longp[999] = 'b';
+	a = acm_new();
+	acm_add(a, "a", 1);
+	acm_add(a, longp, 1000);
+	acm_compile(a);
+	strview_t repl3[] = {strview("x", 1), strview("y", 1)};
+	str = str_new(100001);
+	memset(str->data, 'a', 100000);
+	str->data[100000] = 'b';
+	str->data[100001] = '\0';
+	str->len = 100001;
+	out = str_replace_all(str, a, repl3);
+	fail_unless(out->len == 99002, "99002 bytes expected, got: %d",
+		    out->len);
+	fail_unless(out->data[0] == 'x' && out->data[99000] == 'x' &&
+		    out->data[99001] == 'y', "unexpected output");
+	str_free(out);
+	str_free(str);
+	acm_free(a);
+	free(longp);
+
+	// no patterns
+	a = acm_new();
+	acm_compile(a);
+	fail_unless(acm_find_all(a, "text", 4, 0, 0) == 0, "no matches");
+	acm_free(a);
+}
+END_TEST
+
 //-------------------------------------------------------------------------------
 // FSTR
 //-------------------------------------------------------------------------------
@@ -411,6 +1903,81 @@ START_TEST(test_fstr_add_printf)
 }
 END_TEST
 
+START_TEST(test_fstr_add_numbers)
+{
+	char buf[11];
+	fstr_t fstr;
+
+	FSTR_INIT_FOR_BUF(&fstr, buf);
+	fstr_add_i64(&fstr, -5);
+	fstr_add_u64(&fstr, 17);
+	fstr_add_hex(&fstr, 255);
+	fstr_add_double(&fstr, 0.25);
+	CHECK_STR(&fstr, == 10, == 10, "-517ff0.25");
+
+	FSTR_INIT_FOR_BUF(&fstr, buf);
+	fstr_add_double(&fstr, 3.14);
+	fstr_add_i64(&fstr, INT64_MAX);
+	CHECK_STR(&fstr, == 10, == 10, "3.14922337");
+}
+END_TEST
+
+//-------------------------------------------------------------------------------
+// ISTR
+//-------------------------------------------------------------------------------
+
+START_TEST(test_istr_add)
+{
+	char buf[11];
+	istr_t istr;
+
+	ISTR_INIT_FOR_BUF(&istr, buf);
+	CHECK_STR(&istr, == 10, == 0, "");
+
+	istr_add_cstr(&istr, "hello");
+	istr_add_printf(&istr, "%d", 12345);
+	CHECK_STR(&istr, == 10, == 10, "hello12345");
+	fail_unless(istr.data == buf && allocations == 0,
+		    "the string should stay inline");
+
+	// spills to the heap
+	istr_add_printf(&istr, "%s!", "world");
+	CHECK_STR(&istr, >= 16, == 16, "hello12345world!");
+	fail_unless(istr.heap != 0 && istr.data == istr.heap->data,
+		    "the string should spill to the heap");
+
+	str_t *str = str_from_cstr("...");
+	istr_add_str(&istr, str);
+	istr_add_cstr_len(&istr, "abc", 2);
+	CHECK_STR(&istr, >= 21, == 21, "hello12345world!...ab");
+	str_free(str);
+
+	istr_free(&istr);
+	CHECK_STR(&istr, == 10, == 0, "");
+}
+END_TEST
+
+START_TEST(test_istr_to_str)
+{
+	char buf[8];
+	istr_t istr;
+
+	ISTR_INIT_FOR_BUF(&istr, buf);
+	istr_add_cstr(&istr, "inline");
+	str_t *str = istr_to_str(&istr);
+	CHECK_STR(str, >= 6, == 6, "inline");
+	CHECK_STR(&istr, == 7, == 0, "");
+	str_free(str);
+
+	istr_add_cstr(&istr, "on the heap");
+	str_t *heap = istr.heap;
+	str = istr_to_str(&istr);
+	fail_unless(str == heap, "the heap part should be returned as is");
+	CHECK_STR(str, >= 11, == 11, "on the heap");
+	str_free(str);
+}
+END_TEST
+
 Suite *strstr_suite()
 {
 	Suite *s = suite_create("strstr");
@@ -424,20 +1991,50 @@ Suite *strstr_suite()
 	tcase_add_test(tc_str, test_str_from_cstr);
 	tcase_add_test(tc_str, test_str_from_cstr_len);
 	tcase_add_test(tc_str, test_str_ensure_cap);
+	tcase_add_test(tc_str, test_str_ensure_cap_realloc);
 	tcase_add_test(tc_str, test_str_printf);
 	tcase_add_test(tc_str, test_str_dup);
+	tcase_add_test(tc_str, test_str_freeze);
 	tcase_add_test(tc_str, test_str_from_file);
+	tcase_add_test(tc_str, test_str_from_fd);
+	tcase_add_test(tc_str, test_str_from_files);
+	tcase_add_test(tc_str, test_str_loader);
+	tcase_add_test(tc_str, test_str_new_reserved);
 
 	tcase_add_test(tc_str, test_str_add_str);
 	tcase_add_test(tc_str, test_str_add_cstr);
 	tcase_add_test(tc_str, test_str_add_cstr_len);
 	tcase_add_test(tc_str, test_str_add_printf);
+	tcase_add_test(tc_str, test_str_add_numbers);
 	tcase_add_test(tc_str, test_str_add_file);
+	tcase_add_test(tc_str, test_str_add_fd);
+	tcase_add_test(tc_str, test_str_writev_fd);
 
 	tcase_add_test(tc_str, test_str_trim);
 	tcase_add_test(tc_str, test_str_ltrim);
 	tcase_add_test(tc_str, test_str_rtrim);
+	tcase_add_test(tc_str, test_str_trim_ascii);
 	tcase_add_test(tc_str, test_str_split_path);
+	tcase_add_test(tc_str, test_mstr_from_file);
+	tcase_add_test(tc_str, test_lreader);
+	tcase_add_test(tc_str, test_lreader_chunks);
+	tcase_add_test(tc_str, test_tstr);
+	tcase_add_test(tc_str, test_str_allocator2);
+	tcase_add_test(tc_str, test_str_arena);
+	tcase_add_test(tc_str, test_str_pool);
+	tcase_add_test(tc_str, test_str_pool_threads);
+	tcase_add_test(tc_str, test_spack);
+	tcase_add_test(tc_str, test_lstr);
+	tcase_add_test(tc_str, test_lindex);
+	tcase_add_test(tc_str, test_strview);
+	tcase_add_test(tc_str, test_str_find);
+	tcase_add_test(tc_str, test_acm);
+
+	TCase *tc_stats = tcase_create("stats");
+	tcase_add_checked_fixture(tc_stats,
+				  setup_debug_allocator,
+				  check_allocator_failure);
+	tcase_add_test(tc_stats, test_str_stats);
 
 	TCase *tc_fstr = tcase_create("fstr");
 	tcase_add_checked_fixture(tc_fstr,
@@ -447,8 +2044,25 @@ Suite *strstr_suite()
 	tcase_add_test(tc_fstr, test_fstr_add_str);
 	tcase_add_test(tc_fstr, test_fstr_add_cstr);
 	tcase_add_test(tc_fstr, test_fstr_add_printf);
+	tcase_add_test(tc_fstr, test_fstr_add_numbers);
+
+	TCase *tc_istr = tcase_create("istr");
+	tcase_add_checked_fixture(tc_istr,
+				  setup_debug_allocator,
+				  check_allocator_failure);
+	tcase_add_test(tc_istr, test_istr_add);
+	tcase_add_test(tc_istr, test_istr_to_str);
+
+	TCase *tc_rstr = tcase_create("rstr");
+	tcase_add_checked_fixture(tc_rstr,
+				  setup_debug_allocator,
+				  check_allocator_failure);
+	tcase_add_test(tc_rstr, test_rstr_add);
 
 	suite_add_tcase(s, tc_str);
+	suite_add_tcase(s, tc_stats);
 	suite_add_tcase(s, tc_fstr);
+	suite_add_tcase(s, tc_istr);
+	suite_add_tcase(s, tc_rstr);
 	return s;
 }